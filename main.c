@@ -1,8 +1,32 @@
+#ifdef LINUX
+#define _POSIX_C_SOURCE 200112L
+#endif
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#ifndef HEADLESS
 #include <GLFW/glfw3.h>
 #include <GL/gl.h>
+#else
+#include <time.h>
+#endif
+#if defined(PIPELINE) || RASTER_THREADS > 1 || defined(AUDIO_ALSA) || defined(CAPTURE)
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+#if defined(AUDIO_ALSA) && !defined(HEADLESS)
+#include <alsa/asoundlib.h>
+#endif
+#if defined(CAPTURE) && !defined(HEADLESS)
+#include <time.h>
+#endif
 #include <string.h>
+#ifdef LINUX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* typedefs */
 typedef char                b8;
@@ -13,10 +37,10 @@ typedef unsigned char       u8;
 typedef unsigned short      u16;
 typedef unsigned int        u32;
 typedef float               f32;
+typedef double              f64;
 typedef u32                 rgb;
 typedef u8                  input;
-
-#include "./atlas.h"
+typedef s32                 fx; /* fixed point, see FX_SHIFT */
 
 /* config */
 #define GAME_W  160
@@ -28,12 +52,92 @@ typedef u8                  input;
 #define WINDOW_H (GAME_H * GAME_S)
 #define WINDOW_TITLE "GB11"
 #define TILE_SIZE  8
+#define ATLAS_TW 16 /* tiles per atlas row */
+#define ATLAS_TILES_CAP 256
+#define BLANK_TILE 1 /* fills the empty background cells, load_pack checks it is fully transparent */
+#define LEVELS_CAP 256
+#define LVL_MAX_W  256
+#define LVL_MAX_H  256
+/* levels are streamed in chunks of LVL_CHUNK x LVL_CHUNK tiles, the ones within LVL_CHUNK_MARGIN
+ * tiles of the view are resident. a view of T tiles and its margins span T + 2 * margin + 1 tiles,
+ * which touch at most LVL_CHUNKS_SPAN(T) chunks wherever they start, LVL_CHUNKS_CAP is the product */
+#define LVL_CHUNK        16
+#define LVL_CHUNKS_W     (LVL_MAX_W / LVL_CHUNK)
+#define LVL_CHUNK_MARGIN (LVL_CHUNK / 2)
+#define LVL_CHUNKS_SPAN(T) (((T) + 2 * LVL_CHUNK_MARGIN + LVL_CHUNK - 1) / LVL_CHUNK + 1)
+#define LVL_CHUNKS_CAP   (LVL_CHUNKS_SPAN(GAME_TW) * LVL_CHUNKS_SPAN(GAME_TH))
+#define LEVEL_ENTITIES_CAP 4096
+#define PACK_PATH "gb11.pack"
+/* the simulation always steps at SIM_HZ, catching up at most SIM_MAX_STEPS per frame */
+#define SIM_HZ        60
+#define SIM_DT        (1.0f / SIM_HZ)
+#define SIM_MAX_STEPS 8
+/* simulated positions are fixed point with FX_SHIFT fractional bits, so a step gives the same
+ * result with any compiler and flags. FX_INT floors, it relies on an arithmetic right shift */
+#define FX_SHIFT  8
+#define FX_ONE    (1 << FX_SHIFT)
+#define FX(I)     ((fx)(I) * FX_ONE)
+#define FX_INT(X) ((X) >> FX_SHIFT)
+/* holding select rewinds up to REWIND_SECONDS, the history never takes more than REWIND_ARENA_SZ */
+#define REWIND_SECONDS  5
+#define REWIND_ARENA_SZ (64 * 1024)
+/* frame pacing, FRAME_PACING can be overridden with -D */
+#define PACING_VSYNC    0
+#define PACING_CAPPED   1
+#define PACING_UNCAPPED 2
+#ifndef FRAME_PACING
+#define FRAME_PACING PACING_VSYNC
+#endif
+#ifndef FRAME_CAP_HZ
+#define FRAME_CAP_HZ 60
+#endif
+#ifndef RENDER_INTERPOLATION
+#define RENDER_INTERPOLATION 1
+#endif
+/* how the screen reaches the texture, UPLOAD_PATH can be overridden with -D and F3 cycles it */
+#define UPLOAD_DIRECT     0
+#define UPLOAD_PBO        1
+#define UPLOAD_PERSISTENT 2
+#define UPLOAD_MODES      3
+#ifndef UPLOAD_PATH
+#define UPLOAD_PATH UPLOAD_DIRECT
+#endif
+#define UPLOAD_PBOS 3
+/* with -DPIPELINE a worker thread updates and draws the next frame while the main thread
+ * uploads and presents the current one, they trade frames through PIPELINE_FRAMES buffers */
+#ifdef HEADLESS
+#undef PIPELINE
+#endif
+#define PIPELINE_FRAMES 3
+/* the changed part of a frame is rasterized in bands of RASTER_BAND_H screen rows, with
+ * RASTER_THREADS > 1 (-D) the bands are shared between that many threads */
+#ifndef RASTER_THREADS
+#define RASTER_THREADS 1
+#endif
+#define RASTER_BAND_H 16
+/* audio is synthesized at AUDIO_RATE. the device keeps AUDIO_PERIOD * 2 buffered and is fed
+ * AUDIO_PERIOD samples rendered once they fit, so a sound waits at most a period to be rendered
+ * and a period behind it, 10.7ms, under a video frame. headless renders AUDIO_STEP samples per
+ * simulation step. with -DAUDIO_ALSA it plays on the default alsa device */
+#define AUDIO_RATE   48000
+#define AUDIO_STEP   (AUDIO_RATE / SIM_HZ)
+#define AUDIO_PERIOD 256
+#ifdef HEADLESS
+#undef AUDIO_ALSA
+#endif
+/* with -DCAPTURE, -capture <file> records the game screen. every frame that stepped the simulation
+ * is copied into one of CAPTURE_BUFFERS preallocated buffers and a writer thread encodes them,
+ * to a y4m stream when the file ends in .y4m and to raw frames otherwise. when the writer falls
+ * behind the frame is dropped, headless runs wait for it instead */
+#define CAPTURE_BUFFERS 16
 /* exit codes */
 #define EXIT_GLFW     1
 #define EXIT_WINDOW   2
 #define EXIT_VERTEX   3
 #define EXIT_FRAGMENT 4
 #define EXIT_SHADER   5
+#define EXIT_USAGE    6
+#define EXIT_PACK     7
 
 /* structs */
 typedef struct {
@@ -41,14 +145,29 @@ typedef struct {
   b8 failed;
 } shader_output;
 
+/* levels are compiled from res/levels by make_pack and read in place from the asset pack.
+ * a level is followed by its chunk table, its entities and then by its nul terminated begin
+ * text lines, every position is in tiles and already includes the level offset. the chunk
+ * table covers the chunks from the origin to the far corner of the level, row by row, with
+ * the index of the first entity of each chunk and then the entities amount */
 #define BEGIN_TXT_LINES_CAP 5
 typedef struct {
-  u32 x, y;
-  u32 w, h;
-  s8 *begin_txt[BEGIN_TXT_LINES_CAP];
-  s8 *map;
+  u16 x, y, w, h;
+  u8 player_x, player_y;
+  u8 door_x, door_y;
+  u8 key_x, key_y;
+  u8 begin_txt_lines;
+  u8 pad;
+  u16 entities_amount;
+  u16 begin_txt[BEGIN_TXT_LINES_CAP]; /* offsets from the start of the level */
 } level;
 
+#define LEVEL_ENTITY_ARROW 0
+typedef struct {
+  u8 type, arg;
+  u8 x, y;
+} level_entity;
+
 typedef struct {
   enum {
     FADE_NONE = 0,
@@ -86,6 +205,7 @@ typedef enum {
   D_DOWN
 } direction;
 
+#ifndef HEADLESS
 /* opengl function types */
 typedef void    gl_clear_fn(GLbitfield mask);
 typedef void    gl_clear_color_fn(GLclampf r, GLclampf g, GLclampf b, GLclampf a);
@@ -113,6 +233,15 @@ typedef void    gl_bind_texture_fn(GLenum target, GLuint texture);
 typedef void    gl_tex_parameteri_fn(GLenum target, GLenum pname, GLint param);
 typedef void    gl_tex_image_2d(GLenum target, GLint level, GLint internal_format, GLsizei w, GLsizei h, GLint border, GLenum format, GLenum type, const void *data);
 typedef void    gl_tex_sub_image_2d(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void * pixels);
+typedef GLint   gl_get_uniform_location_fn(GLuint program, const GLchar *name);
+typedef void    gl_uniform_3fv_fn(GLint location, GLsizei count, const GLfloat *value);
+typedef void    gl_pixel_storei_fn(GLenum pname, GLint param);
+typedef void   *gl_map_buffer_range_fn(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean gl_unmap_buffer_fn(GLenum target);
+typedef void    gl_buffer_storage_fn(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+typedef GLsync  gl_fence_sync_fn(GLenum condition, GLbitfield flags);
+typedef GLenum  gl_client_wait_sync_fn(GLsync sync, GLbitfield flags, GLuint64 timeout);
+typedef void    gl_delete_sync_fn(GLsync sync);
 
 /* opengl functions */
 gl_clear_fn                       *_glClear;
@@ -141,6 +270,15 @@ gl_bind_texture_fn                *_glBindTexture;
 gl_tex_parameteri_fn              *_glTexParameteri;
 gl_tex_image_2d                   *_glTexImage2D;
 gl_tex_sub_image_2d               *_glTexSubImage2D;
+gl_get_uniform_location_fn        *_glGetUniformLocation;
+gl_uniform_3fv_fn                 *_glUniform3fv;
+gl_pixel_storei_fn                *_glPixelStorei;
+gl_map_buffer_range_fn            *_glMapBufferRange;
+gl_unmap_buffer_fn                *_glUnmapBuffer;
+gl_buffer_storage_fn              *_glBufferStorage;
+gl_fence_sync_fn                  *_glFenceSync;
+gl_client_wait_sync_fn            *_glClientWaitSync;
+gl_delete_sync_fn                 *_glDeleteSync;
 
 #define glClear                     _glClear
 #define glClearColor                _glClearColor
@@ -168,16 +306,235 @@ gl_tex_sub_image_2d               *_glTexSubImage2D;
 #define glTexParameteri             _glTexParameteri
 #define glTexImage2D                _glTexImage2D
 #define glTexSubImage2D             _glTexSubImage2D
+#define glGetUniformLocation        _glGetUniformLocation
+#define glUniform3fv                _glUniform3fv
+#define glPixelStorei               _glPixelStorei
+#define glMapBufferRange            _glMapBufferRange
+#define glUnmapBuffer               _glUnmapBuffer
+#define glBufferStorage             _glBufferStorage
+#define glFenceSync                 _glFenceSync
+#define glClientWaitSync            _glClientWaitSync
+#define glDeleteSync                _glDeleteSync
+#endif
 
 /* input */
 input key_cur;
 input key_prv;
+input key_held; /* written by the keyboard, sampled into key_cur once per frame */
 #define input_get(I, K) (((I) & (K)) == (K))
 #define input_set(I, K) ((I) |=  (K))
 #define input_clr(I, K) ((I) &= ~(K))
 #define key_press(K) input_get(key_cur, K)
 #define key_click(K) (input_get(key_cur, K) && !input_get(key_prv, K))
 
+/* replays hold the input of every simulation step as {u8 steps, u8 input} runs after a
+ * replay_header, the simulation has a fixed step so the input is all that's needed */
+#define REPLAY_MAGIC   "GB11RPLY"
+#define REPLAY_VERSION 1
+typedef struct {
+  s8 magic[8];
+  u32 version;
+  u32 sim_hz;
+} replay_header;
+
+typedef enum {
+  REPLAY_NONE = 0,
+  REPLAY_RECORD,
+  REPLAY_PLAY
+} replay_mode;
+replay_mode replay;
+FILE *replay_file;
+input replay_input;
+u32 replay_steps; /* recording: steps in the current run. playing: steps left in it */
+b8 replay_finished;
+
+b8
+replay_open(replay_mode mode, const s8 *path) {
+  replay_header header;
+  if (!(replay_file = fopen(path, mode == REPLAY_RECORD ? "wb" : "rb"))) {
+    fprintf(stderr, "error: couldn't open '%s'\n", path);
+    return 0;
+  }
+  if (mode == REPLAY_RECORD) {
+    memcpy(header.magic, REPLAY_MAGIC, sizeof (header.magic));
+    header.version = REPLAY_VERSION;
+    header.sim_hz  = SIM_HZ;
+    fwrite(&header, sizeof (header), 1, replay_file);
+  } else if (fread(&header, sizeof (header), 1, replay_file) != 1 ||
+      memcmp(header.magic, REPLAY_MAGIC, sizeof (header.magic)) ||
+      header.version != REPLAY_VERSION || header.sim_hz != SIM_HZ) {
+    fprintf(stderr, "error: '%s' isn't a replay of this version\n", path);
+    fclose(replay_file);
+    return 0;
+  }
+  replay = mode;
+  replay_steps = 0;
+  return 1;
+}
+
+void
+replay_write_run(void) {
+  u8 run[2];
+  run[0] = replay_steps;
+  run[1] = replay_input;
+  fwrite(run, sizeof (run), 1, replay_file);
+}
+
+void
+replay_close(void) {
+  if (replay == REPLAY_RECORD && replay_steps) replay_write_run();
+  if (replay) fclose(replay_file);
+  replay = REPLAY_NONE;
+}
+
+/* called once per simulation step, records key_cur or replaces it */
+void
+replay_step(void) {
+  if (replay == REPLAY_RECORD) {
+    if (replay_steps && (key_cur != replay_input || replay_steps == 0xff)) {
+      replay_write_run();
+      replay_steps = 0;
+    }
+    replay_input = key_cur;
+    replay_steps++;
+  } else if (replay == REPLAY_PLAY) {
+    if (!replay_steps) {
+      u8 run[2];
+      if (fread(run, sizeof (run), 1, replay_file) != 1 || !run[0]) {
+        replay_close();
+        replay_finished = 1;
+        key_cur = 0;
+        return;
+      }
+      replay_steps = run[0];
+      replay_input = run[1];
+    }
+    key_cur = replay_input;
+    replay_steps--;
+  }
+}
+
+/* handles "-record <file>" and "-replay <file>" */
+b8
+replay_option(const s8 *option, const s8 *path) {
+  if (!path || replay) return 0;
+  if (!strcmp(option, "-record")) return replay_open(REPLAY_RECORD, path);
+  if (!strcmp(option, "-replay")) return replay_open(REPLAY_PLAY, path);
+  return 0;
+}
+
+/* monotonic wall clock in seconds, for timings */
+f64
+time_now(void) {
+#ifndef HEADLESS
+  return glfwGetTime();
+#elif defined(LINUX)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+#else
+  return (f64)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* profiler, only compiled in with -DPROFILE */
+#ifdef PROFILE
+typedef enum {
+  PHASE_UPDATE = 0,
+  PHASE_CLEAR,
+  PHASE_DRAW,
+  PHASE_RASTER,
+  PHASE_UPLOAD,
+  PHASE_SWAP,
+  PHASES_AMOUNT
+} profile_phase;
+
+#define PROFILE_FRAMES     256
+#define PROFILE_STATS_RATE 32
+#define PROFILE_TRACE_PATH "trace.json"
+s8 *profile_phase_names[PHASES_AMOUNT] = { "update", "clear", "draw", "raster", "upload", "swap" };
+s8 *profile_phase_labels[PHASES_AMOUNT] = { "UPD", "CLR", "DRW", "RAS", "UPL", "SWP" };
+f64 profile_begin_time[PROFILE_FRAMES][PHASES_AMOUNT];
+f64 profile_duration[PROFILE_FRAMES][PHASES_AMOUNT];
+u32 profile_frame;
+b8 profile_hud;
+b8 profile_export_requested;
+u32 profile_stats[PHASES_AMOUNT][3]; /* min, avg and p99 in microseconds */
+/* the headless build has nothing to upload or present, its trace and stats stop before those */
+#ifdef HEADLESS
+#define PROFILE_PHASES PHASE_UPLOAD
+#else
+#define PROFILE_PHASES PHASES_AMOUNT
+#endif
+
+#ifdef PIPELINE
+/* the phases before the upload run on the pipeline worker, it times them into these and hands
+ * them over with the frame, they land in the row of the frame that presents it */
+f64 profile_worker_begin_time[PHASE_UPLOAD];
+f64 profile_worker_duration[PHASE_UPLOAD];
+#define profile_entry(A, P) (*((P) < PHASE_UPLOAD ? &profile_worker_##A[P] : &profile_##A[profile_frame % PROFILE_FRAMES][P]))
+#else
+#define profile_entry(A, P) (profile_##A[profile_frame % PROFILE_FRAMES][P])
+#endif
+#define profile_begin(P) (profile_entry(begin_time, P) = time_now())
+#define profile_end(P)   (profile_entry(duration, P) = time_now() - profile_entry(begin_time, P))
+
+void
+profile_compute_stats(void) {
+  f64 sorted[PROFILE_FRAMES];
+  u32 p, i, j, amount = profile_frame < PROFILE_FRAMES ? profile_frame : PROFILE_FRAMES;
+  if (!amount) return;
+  for (p = 0; p < PROFILE_PHASES; p++) {
+    f64 total = 0;
+    for (i = 0; i < amount; i++) {
+      f64 d = profile_duration[i][p];
+      total += d;
+      for (j = i; j > 0 && sorted[j - 1] > d; j--) sorted[j] = sorted[j - 1];
+      sorted[j] = d;
+    }
+    profile_stats[p][0] = sorted[0] * 1000000;
+    profile_stats[p][1] = total / amount * 1000000;
+    profile_stats[p][2] = sorted[(amount * 99) / 100] * 1000000;
+  }
+}
+
+void
+profile_next_frame(void) {
+  profile_frame++;
+  if (profile_frame % PROFILE_STATS_RATE == 0) profile_compute_stats();
+}
+
+/* writes the last PROFILE_FRAMES frames as chrome trace events */
+void
+profile_export_trace(void) {
+  u32 i, p, first = profile_frame > PROFILE_FRAMES ? profile_frame - PROFILE_FRAMES : 0;
+  b8 comma = 0;
+  FILE *trace = fopen(PROFILE_TRACE_PATH, "w");
+  if (!trace) {
+    fprintf(stderr, "error: couldn't open '%s'\n", PROFILE_TRACE_PATH);
+    return;
+  }
+  fprintf(trace, "{\"traceEvents\":[\n");
+  for (i = first; i < profile_frame; i++) {
+    for (p = 0; p < PROFILE_PHASES; p++) {
+      fprintf(trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+          comma ? ",\n" : "", profile_phase_names[p],
+          profile_begin_time[i % PROFILE_FRAMES][p] * 1000000,
+          profile_duration[i % PROFILE_FRAMES][p] * 1000000, i);
+      comma = 1;
+    }
+  }
+  fprintf(trace, "\n]}\n");
+  fclose(trace);
+  fprintf(stderr, "profile: wrote %u frames to '%s'\n", profile_frame - first, PROFILE_TRACE_PATH);
+}
+#else
+#define profile_begin(P)     ((void)0)
+#define profile_end(P)       ((void)0)
+#define profile_next_frame() ((void)0)
+#endif
+
+#ifndef HEADLESS
 /* shader sources */
 s8 *vert_src =
 "#version 330 core\n"
@@ -195,9 +552,10 @@ s8 *frag_src =
 "out vec4 f_col;\n"
 "in vec2 v_uv;"
 "uniform sampler2D tex;"
+"uniform vec3 pal[4];"
 "void\n"
 "main() {\n"
-"  f_col = texture(tex, v_uv);\n"
+"  f_col = vec4(pal[int(texture(tex, v_uv).r * 255.0 + 0.5)], 1.0);\n"
 "}\n"
 "\n";
 
@@ -219,6 +577,7 @@ make_shader(GLenum type, const s8 *src) {
   }
   return output;
 }
+#endif
 
 b8
 rect_collide(s32 x1_min, s32 y1_min, s32 x1_max, s32 y1_max, s32 x2_min, s32 y2_min, s32 x2_max, s32 y2_max) {
@@ -226,52 +585,273 @@ rect_collide(s32 x1_min, s32 y1_min, s32 x1_max, s32 y1_max, s32 x2_min, s32 y2_
          y1_max > y2_min && y1_min < y2_max;
 }
 
+#ifndef HEADLESS
 /* callbacks */
+b8 upload_cycle_requested;
+
 void
 key_callback(GLFWwindow *window, s32 key, s32 scancode, s32 action, s32 mods) {
   (void)window; (void)scancode; (void)mods;
   if (action == GLFW_REPEAT) return;
   if (action == GLFW_PRESS) {
     switch (key) {
-      case GLFW_KEY_W: input_set(key_cur, K_UP);     break;
-      case GLFW_KEY_A: input_set(key_cur, K_LEFT);   break;
-      case GLFW_KEY_D: input_set(key_cur, K_RIGHT);  break;
-      case GLFW_KEY_S: input_set(key_cur, K_DOWN);   break;
-      case GLFW_KEY_J: input_set(key_cur, K_A);      break;
-      case GLFW_KEY_K: input_set(key_cur, K_B);      break;
-      case GLFW_KEY_U: input_set(key_cur, K_START);  break;
-      case GLFW_KEY_I: input_set(key_cur, K_SELECT); break;
+      case GLFW_KEY_W: input_set(key_held, K_UP);     break;
+      case GLFW_KEY_A: input_set(key_held, K_LEFT);   break;
+      case GLFW_KEY_D: input_set(key_held, K_RIGHT);  break;
+      case GLFW_KEY_S: input_set(key_held, K_DOWN);   break;
+      case GLFW_KEY_J: input_set(key_held, K_A);      break;
+      case GLFW_KEY_K: input_set(key_held, K_B);      break;
+      case GLFW_KEY_U: input_set(key_held, K_START);  break;
+      case GLFW_KEY_I: input_set(key_held, K_SELECT); break;
+      case GLFW_KEY_F3: upload_cycle_requested = 1;  break;
+#ifdef PROFILE
+      case GLFW_KEY_F1: profile_hud = !profile_hud;       break;
+      case GLFW_KEY_F2: profile_export_requested = 1;     break;
+#endif
     }
   } else {
     switch (key) {
-      case GLFW_KEY_W: input_clr(key_cur, K_UP);     break;
-      case GLFW_KEY_A: input_clr(key_cur, K_LEFT);   break;
-      case GLFW_KEY_D: input_clr(key_cur, K_RIGHT);  break;
-      case GLFW_KEY_S: input_clr(key_cur, K_DOWN);   break;
-      case GLFW_KEY_J: input_clr(key_cur, K_A);      break;
-      case GLFW_KEY_K: input_clr(key_cur, K_B);      break;
-      case GLFW_KEY_U: input_clr(key_cur, K_START);  break;
-      case GLFW_KEY_I: input_clr(key_cur, K_SELECT); break;
+      case GLFW_KEY_W: input_clr(key_held, K_UP);     break;
+      case GLFW_KEY_A: input_clr(key_held, K_LEFT);   break;
+      case GLFW_KEY_D: input_clr(key_held, K_RIGHT);  break;
+      case GLFW_KEY_S: input_clr(key_held, K_DOWN);   break;
+      case GLFW_KEY_J: input_clr(key_held, K_A);      break;
+      case GLFW_KEY_K: input_clr(key_held, K_B);      break;
+      case GLFW_KEY_U: input_clr(key_held, K_START);  break;
+      case GLFW_KEY_I: input_clr(key_held, K_SELECT); break;
+    }
+  }
+}
+#endif
+
+/* asset pack, see res/make_pack.c for the layout. it is mapped read-only and
+ * used in place, so only the pages of what is actually used get touched */
+#define PACK_MAGIC     "GB11PACK"
+#define PACK_VERSION   2
+#define PACK_NAME_SIZE 16
+typedef struct {
+  s8 magic[8];
+  u32 version;
+  u32 entries_amount;
+} pack_header;
+
+typedef struct {
+  s8 name[PACK_NAME_SIZE];
+  u32 offset, size;
+} pack_entry;
+
+const u8 *pack;
+u32 pack_size;
+const u8 *atlas, *atlas_mask;
+u32 atlas_tiles;
+const level *levels[LEVELS_CAP];
+u32 levels_size[LEVELS_CAP];
+b8 levels_checked[LEVELS_CAP];
+u32 levels_amount;
+
+b8
+load_pack(const s8 *path) {
+  const pack_header *header;
+  const pack_entry *entries;
+  const u8 zero_row[TILE_SIZE] = { 0 };
+  u32 i;
+#ifdef LINUX
+  struct stat st;
+  s32 fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "error: couldn't open '%s'\n", path);
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  pack_size = st.st_size;
+  pack = mmap(0, pack_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (pack == MAP_FAILED) {
+    fprintf(stderr, "error: couldn't map '%s'\n", path);
+    return 0;
+  }
+#else
+  u8 *data;
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "error: couldn't open '%s'\n", path);
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  pack_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data = malloc(pack_size);
+  if (!data || fread(data, 1, pack_size, file) != pack_size) {
+    fprintf(stderr, "error: couldn't read '%s'\n", path);
+    fclose(file);
+    free(data);
+    return 0;
+  }
+  fclose(file);
+  pack = data;
+#endif
+  header = (const pack_header *)pack;
+  if (pack_size < sizeof (pack_header) || memcmp(header->magic, PACK_MAGIC, sizeof (header->magic)) ||
+      header->version != PACK_VERSION ||
+      header->entries_amount > (pack_size - sizeof (pack_header)) / sizeof (pack_entry)) {
+    fprintf(stderr, "error: '%s' is not a version %u pack\n", path, PACK_VERSION);
+    return 0;
+  }
+  entries = (const pack_entry *)(header + 1);
+  atlas = 0;
+  levels_amount = 0;
+  for (i = 0; i < header->entries_amount; i++) {
+    const pack_entry *entry = &entries[i];
+    if (entry->offset > pack_size || entry->size > pack_size - entry->offset) {
+      fprintf(stderr, "error: pack entry %u is out of bounds\n", i);
+      return 0;
+    }
+    if (!strncmp(entry->name, "atlas", PACK_NAME_SIZE)) {
+      /* u32 w, h, tiles and padding, then the planes and the masks */
+      const u32 *info = (const u32 *)(pack + entry->offset);
+      if (entry->size < 16 || info[0] != ATLAS_TW * TILE_SIZE || info[2] > ATLAS_TILES_CAP ||
+          entry->size < 16 + info[2] * TILE_SIZE * 3) {
+        fprintf(stderr, "error: bad atlas in pack\n");
+        return 0;
+      }
+      atlas_tiles = info[2];
+      atlas       = pack + entry->offset + 16;
+      atlas_mask  = atlas + atlas_tiles * TILE_SIZE * 2;
+      if (atlas_tiles <= BLANK_TILE || memcmp(&atlas_mask[BLANK_TILE * TILE_SIZE], zero_row, TILE_SIZE)) {
+        fprintf(stderr, "error: atlas tile %u has to be fully transparent\n", BLANK_TILE);
+        return 0;
+      }
+    } else if (!strncmp(entry->name, "level", PACK_NAME_SIZE)) {
+      if (levels_amount == LEVELS_CAP) {
+        fprintf(stderr, "error: more than %u levels in pack\n", LEVELS_CAP);
+        return 0;
+      }
+      levels[levels_amount] = (const level *)(pack + entry->offset);
+      levels_size[levels_amount] = entry->size;
+      levels_checked[levels_amount] = 0;
+      levels_amount++;
+    }
+  }
+  if (!atlas || !levels_amount) {
+    fprintf(stderr, "error: pack needs an atlas and at least one level\n");
+    return 0;
+  }
+  return 1;
+}
+
+/* -pack <file> plays another pack, like the test levels */
+const s8 *pack_path = PACK_PATH;
+
+b8
+pack_option(const s8 *option, const s8 *path) {
+  if (!path || strcmp(option, "-pack")) return 0;
+  pack_path = path;
+  return 1;
+}
+
+#define level_chunks_w(L)     (((u32)(L)->x + (L)->w + LVL_CHUNK - 1) / LVL_CHUNK)
+#define level_chunks_h(L)     (((u32)(L)->y + (L)->h + LVL_CHUNK - 1) / LVL_CHUNK)
+#define level_chunk_table(L)  ((const u16 *)((L) + 1))
+#define level_entities(L)     ((const level_entity *)(level_chunk_table(L) + level_chunks_w(L) * level_chunks_h(L) + 1))
+#define level_begin_txt(L, I) ((const s8 *)(L) + (L)->begin_txt[I])
+
+/* levels are checked the first time they are used instead of when the pack is loaded */
+const level *
+get_level(u32 level_idx) {
+  const level *lvl = levels[level_idx];
+  const u16 *table;
+  u32 i, c, chunks, size = levels_size[level_idx];
+  if (levels_checked[level_idx]) return lvl;
+  if (size < sizeof (level) || lvl->begin_txt_lines > BEGIN_TXT_LINES_CAP || !lvl->w || !lvl->h ||
+      lvl->x + lvl->w > LVL_MAX_W || lvl->y + lvl->h > LVL_MAX_H) {
+    fprintf(stderr, "error: bad level %u in pack\n", level_idx);
+    exit(EXIT_PACK);
+  }
+  chunks = level_chunks_w(lvl) * level_chunks_h(lvl);
+  if (size < sizeof (level) + (chunks + 1) * sizeof (u16) || lvl->entities_amount > LEVEL_ENTITIES_CAP ||
+      lvl->entities_amount > (size - sizeof (level) - (chunks + 1) * sizeof (u16)) / sizeof (level_entity)) {
+    fprintf(stderr, "error: bad level %u in pack\n", level_idx);
+    exit(EXIT_PACK);
+  }
+  /* these are only found through the chunk they are in */
+  if (lvl->player_x < lvl->x || lvl->player_x >= lvl->x + lvl->w || lvl->player_y < lvl->y || lvl->player_y >= lvl->y + lvl->h ||
+      lvl->door_x   < lvl->x || lvl->door_x   >= lvl->x + lvl->w || lvl->door_y   < lvl->y || lvl->door_y   >= lvl->y + lvl->h ||
+      lvl->key_x    < lvl->x || lvl->key_x    >= lvl->x + lvl->w || lvl->key_y    < lvl->y || lvl->key_y    >= lvl->y + lvl->h) {
+    fprintf(stderr, "error: bad level %u in pack\n", level_idx);
+    exit(EXIT_PACK);
+  }
+  table = level_chunk_table(lvl);
+  if (table[0] || table[chunks] != lvl->entities_amount) {
+    fprintf(stderr, "error: bad chunk table in level %u\n", level_idx);
+    exit(EXIT_PACK);
+  }
+  for (c = 0; c < chunks; c++) {
+    if (table[c] > table[c + 1]) {
+      fprintf(stderr, "error: bad chunk table in level %u\n", level_idx);
+      exit(EXIT_PACK);
+    }
+    for (i = table[c]; i < table[c + 1]; i++) {
+      const level_entity *e = &level_entities(lvl)[i];
+      if (e->x / LVL_CHUNK != c % level_chunks_w(lvl) || e->y / LVL_CHUNK != c / level_chunks_w(lvl)) {
+        fprintf(stderr, "error: bad entity in level %u\n", level_idx);
+        exit(EXIT_PACK);
+      }
+    }
+  }
+  for (i = 0; i < lvl->begin_txt_lines; i++) {
+    if (lvl->begin_txt[i] >= size || !memchr((const u8 *)lvl + lvl->begin_txt[i], 0, size - lvl->begin_txt[i])) {
+      fprintf(stderr, "error: bad text in level %u\n", level_idx);
+      exit(EXIT_PACK);
     }
   }
+  levels_checked[level_idx] = 1;
+  return lvl;
 }
 
 /* renderer */
-rgb screen[GAME_W*GAME_H];
+/* the screen holds color indices, they are resolved through the palette on the gpu */
+u8 screen[GAME_W*GAME_H];
 rgb colors[COLORS_AMOUNT] = { 0x9bbc0f, 0x8bac0f, 0x306230, 0x0f380f };
-rgb palette[COLORS_AMOUNT];
 s32 bound_x_min, bound_y_min, bound_x_max, bound_y_max;
+s32 camera_x, camera_y; /* subtracted from the positions of what is drawn */
+/* the area a raster call may write to, inclusive */
+typedef struct {
+  s32 x_min, y_min, x_max, y_max;
+} clip_rect;
+b8 tile_has_transparency[ATLAS_TILES_CAP];
+
+/* expands one bitplane byte into 8 pixels of 0 or 1, msb first */
+typedef union {
+  u32 w[2];
+  u8 px[TILE_SIZE];
+} tile_row;
+tile_row plane_lut[256];
 
 void
-clear_screen(u8 color_index) {
-  u32 i;
-  for (i = 0; i < GAME_W*GAME_H; i++) {
-    screen[i] = palette[color_index];
+init_tiles(void) {
+  u32 i, j;
+  for (i = 0; i < 256; i++) {
+    for (j = 0; j < TILE_SIZE; j++) plane_lut[i].px[j] = (i >> (7 - j)) & 1;
+  }
+  for (i = 0; i < atlas_tiles; i++) {
+    tile_has_transparency[i] = 0;
+    for (j = 0; j < TILE_SIZE; j++) {
+      if (atlas_mask[i * TILE_SIZE + j] != 0xff) tile_has_transparency[i] = 1;
+    }
   }
 }
 
+#define decode_tile_row(ROW, LO, HI) do {\
+  (ROW).w[0] = plane_lut[LO].w[0] | (plane_lut[HI].w[0] << 1);\
+  (ROW).w[1] = plane_lut[LO].w[1] | (plane_lut[HI].w[1] << 1);\
+} while (0)
+
 void
 set_drawing_bounds(s32 x_min, s32 y_min, s32 x_max, s32 y_max) {
+  x_min -= camera_x;
+  y_min -= camera_y;
+  x_max -= camera_x;
+  y_max -= camera_y;
   if (x_min < 0) x_min = 0;
   if (y_min < 0) y_min = 0;
   if (x_max > GAME_W) x_max = GAME_W;
@@ -290,566 +870,1500 @@ reset_drawing_bounds(void) {
   bound_y_max = GAME_H - 1;
 }
 
+/* fills the whole clip */
 void
-draw_rect(s32 x_min, s32 y_min, s32 x_max, s32 y_max, u8 color_index) {
-  s32 x, y;
-  if (x_max < bound_x_min || x_min > bound_x_max ||
-      y_max < bound_y_min || y_min > bound_y_max) return;
-  for (y = y_min; y < y_max; y++) {
-    if (y < bound_y_min) continue;
-    if (y > bound_y_max) break;
-    for (x = x_min; x < x_max; x++) {
-      if (x < bound_x_min) continue;
-      if (x > bound_x_max) break;
-      screen[y * GAME_W + x] = palette[color_index];
-    }
+raster_rect(const clip_rect *clip, u8 color_index) {
+  s32 y, w = clip->x_max - clip->x_min + 1;
+  u8 *dst;
+  /* spans are filled with memset, which already picks the widest stores the cpu has */
+  dst = &screen[clip->y_min * GAME_W + clip->x_min];
+  if (w == GAME_W) {
+    memset(dst, color_index, (clip->y_max - clip->y_min + 1) * GAME_W);
+    return;
   }
+  for (y = clip->y_min; y <= clip->y_max; y++, dst += GAME_W) memset(dst, color_index, w);
 }
 
 void
-draw_tile(s32 x, s32 y, u32 tile_x, u32 tile_y) {
-  u32 tx, ty;
-  s32 px = x, py = y;
-  if (x + TILE_SIZE < bound_x_min || x > bound_x_max ||
-      y + TILE_SIZE < bound_y_min || y > bound_y_max) return;
-  for (tx = 0; tx < ATLAS_H / TILE_SIZE; tx++) {
-    for (ty = 0; ty < ATLAS_W / TILE_SIZE; ty++) {
-      if (tx == tile_x && ty == tile_y) {
-        u32 ox, oy;
-        for (oy = 0; oy < TILE_SIZE; oy++) {
-          py = y + oy;
-          if (py < bound_y_min) continue;
-          if (py > bound_y_max) break;
-          for (ox = 0; ox < TILE_SIZE; ox++) {
-            u8 color_index;
-            s32 ax, ay;
-            px = x + ox;
-            if (px < bound_x_min) continue;
-            if (px > bound_x_max) break;
-            ax = (tx * TILE_SIZE + ox);
-            ay = (ty * TILE_SIZE + oy);
-            color_index = atlas[ay * ATLAS_W + ax];
-            if (color_index < TRANSPARENT) {
-              screen[py * GAME_W + px] = palette[color_index];
-            }
-          }
+raster_tile(const clip_rect *clip, s32 x, s32 y, u32 tile_x, u32 tile_y) {
+  s32 ox, oy, ox_min, oy_min, ox_max, oy_max;
+  u32 tile;
+  const u8 *src, *mask;
+  u8 *dst;
+  tile_row row;
+  if (tile_x >= ATLAS_TW || tile_y * ATLAS_TW + tile_x >= atlas_tiles) return;
+  if (x + TILE_SIZE <= clip->x_min || x > clip->x_max ||
+      y + TILE_SIZE <= clip->y_min || y > clip->y_max) return;
+  tile = tile_y * ATLAS_TW + tile_x;
+  src  = &atlas[tile * TILE_SIZE * 2];
+  mask = &atlas_mask[tile * TILE_SIZE];
+  if (x >= clip->x_min && x + TILE_SIZE - 1 <= clip->x_max &&
+      y >= clip->y_min && y + TILE_SIZE - 1 <= clip->y_max) {
+    /* fully visible */
+    dst = &screen[y * GAME_W + x];
+    if (!tile_has_transparency[tile]) {
+      for (oy = 0; oy < TILE_SIZE; oy++, src += 2, dst += GAME_W) {
+        decode_tile_row(row, src[0], src[1]);
+        for (ox = 0; ox < TILE_SIZE; ox++) dst[ox] = row.px[ox];
+      }
+    } else {
+      for (oy = 0; oy < TILE_SIZE; oy++, src += 2, dst += GAME_W) {
+        decode_tile_row(row, src[0], src[1]);
+        for (ox = 0; ox < TILE_SIZE; ox++) {
+          if (plane_lut[mask[oy]].px[ox]) dst[ox] = row.px[ox];
         }
       }
     }
+    return;
+  }
+  /* partly clipped */
+  ox_min = x < clip->x_min ? clip->x_min - x : 0;
+  oy_min = y < clip->y_min ? clip->y_min - y : 0;
+  ox_max = x + TILE_SIZE - 1 > clip->x_max ? clip->x_max - x + 1 : TILE_SIZE;
+  oy_max = y + TILE_SIZE - 1 > clip->y_max ? clip->y_max - y + 1 : TILE_SIZE;
+  src += oy_min * 2;
+  dst = &screen[(y + oy_min) * GAME_W + x];
+  if (!tile_has_transparency[tile]) {
+    for (oy = oy_min; oy < oy_max; oy++, src += 2, dst += GAME_W) {
+      decode_tile_row(row, src[0], src[1]);
+      for (ox = ox_min; ox < ox_max; ox++) dst[ox] = row.px[ox];
+    }
+  } else {
+    for (oy = oy_min; oy < oy_max; oy++, src += 2, dst += GAME_W) {
+      decode_tile_row(row, src[0], src[1]);
+      for (ox = ox_min; ox < ox_max; ox++) {
+        if (plane_lut[mask[oy]].px[ox]) dst[ox] = row.px[ox];
+      }
+    }
   }
 }
 
+/* text */
+#define GLYPH_SKIP 0xffff
+u16 glyph_tiles[256];
+
 void
-draw_text(s32 x, s32 y, s8 *fmt, ...) {
+init_glyphs(void) {
   u32 i;
-  s8 txt[128];
-  va_list args;
-  va_start(args, fmt);
-  vsprintf(txt, fmt, args);
-  va_end(args);
-  for (i = 0; i < 128; i++) {
-    if (txt[i] == '\0') {
-      break;
-    } else if (txt[i] >= 'A' && txt[i] <= 'P') {
-      draw_tile(x, y, txt[i] - 'A', 13);
-    } else if (txt[i] >= 'Q' && txt[i] <= 'Z') {
-      draw_tile(x, y, txt[i] - 'Q', 14);
-    } else if (txt[i] >= '0' && txt[i] <= '1') {
-      draw_tile(x, y, txt[i] - '0', 15);
-    } else if (txt[i] != ' ') {
-      switch (txt[i]) {
-        case '.':  draw_tile(x, y, 10, 14); break;
-        case ',':  draw_tile(x, y, 11, 14); break;
-        case ':':  draw_tile(x, y, 12, 14); break;
-        case ';':  draw_tile(x, y, 13, 14); break;
-        case '?':  draw_tile(x, y, 14, 14); break;
-        case '!':  draw_tile(x, y, 15, 14); break;
-        case '-':  draw_tile(x, y, 10, 15); break;
-        case '(':  draw_tile(x, y, 11, 15); break;
-        case ')':  draw_tile(x, y, 12, 15); break;
-        case '"':  draw_tile(x, y, 15, 15); break;
-        case '\'': draw_tile(x, y, 14, 15); break;
-        default:   draw_tile(x, y, 15, 15); break;
-      }
-    }
-    x += TILE_SIZE;
-  }
+  for (i = 0; i < 256; i++) glyph_tiles[i] = 15 * ATLAS_TW + 15;
+  for (i = 'A'; i <= 'P'; i++) glyph_tiles[i] = 13 * ATLAS_TW + (i - 'A');
+  for (i = 'Q'; i <= 'Z'; i++) glyph_tiles[i] = 14 * ATLAS_TW + (i - 'Q');
+  for (i = '0'; i <= '9'; i++) glyph_tiles[i] = 15 * ATLAS_TW + (i - '0');
+  glyph_tiles[' ']  = GLYPH_SKIP;
+  glyph_tiles['.']  = 14 * ATLAS_TW + 10;
+  glyph_tiles[',']  = 14 * ATLAS_TW + 11;
+  glyph_tiles[':']  = 14 * ATLAS_TW + 12;
+  glyph_tiles[';']  = 14 * ATLAS_TW + 13;
+  glyph_tiles['?']  = 14 * ATLAS_TW + 14;
+  glyph_tiles['!']  = 14 * ATLAS_TW + 15;
+  glyph_tiles['-']  = 15 * ATLAS_TW + 10;
+  glyph_tiles['(']  = 15 * ATLAS_TW + 11;
+  glyph_tiles[')']  = 15 * ATLAS_TW + 12;
+  glyph_tiles['"']  = 15 * ATLAS_TW + 13;
+  glyph_tiles['\''] = 15 * ATLAS_TW + 14;
 }
 
-/* gameplay stuff */
-f32 player_x,  player_y;
-s32 player_nx, player_ny;
-b8 player_walking;
-direction player_dir;
+/* text runs are whole lines rasterized once, with a byte mask of 0xff on the opaque pixels */
+#define TEXT_RUNS_CAP      32
+#define TEXT_RUNS_ARENA_SZ (TEXT_RUNS_CAP * 16 * TILE_SIZE * TILE_SIZE)
+typedef struct {
+  s32 w;
+  u32 offset;
+} text_run;
+text_run text_runs[TEXT_RUNS_CAP];
+u32 text_runs_amount;
+u8 text_runs_pixels[TEXT_RUNS_ARENA_SZ];
+u8 text_runs_mask[TEXT_RUNS_ARENA_SZ];
+u32 text_runs_arena_used;
+u32 text_runs_generation; /* bumped when the cache is emptied, so reused run indices don't look unchanged */
 
-s32 door_x, door_y;
-s32 key_x, key_y;
-b8 key_collected;
+void
+raster_text_run(const clip_rect *clip, s32 x, s32 y, u32 run) {
+  s32 oy, ox, ox_min, oy_min, ox_max, oy_max, w = text_runs[run].w;
+  const u8 *src, *mask;
+  u8 *dst;
+  ox_min = x < clip->x_min ? clip->x_min - x : 0;
+  oy_min = y < clip->y_min ? clip->y_min - y : 0;
+  ox_max = x + w - 1 > clip->x_max ? clip->x_max - x + 1 : w;
+  oy_max = y + TILE_SIZE - 1 > clip->y_max ? clip->y_max - y + 1 : TILE_SIZE;
+  if (ox_min >= ox_max || oy_min >= oy_max) return;
+  src  = &text_runs_pixels[text_runs[run].offset + oy_min * w];
+  mask = &text_runs_mask[text_runs[run].offset + oy_min * w];
+  dst  = &screen[(y + oy_min) * GAME_W + x];
+  for (oy = oy_min; oy < oy_max; oy++, src += w, mask += w, dst += GAME_W) {
+    for (ox = ox_min; ox < ox_max; ox++) dst[ox] = (dst[ox] & ~mask[ox]) | (src[ox] & mask[ox]);
+  }
+}
 
-b8 grow_level;
-direction grow_level_dir;
-f32 level_x_min, level_x_max, level_y_min, level_y_max;
-s32 level_nx_min, level_nx_max, level_ny_min, level_ny_max;
+/* retained layers modeled on the game boy ppu: a scrolling background map, a window map
+ * and 40 sprites, composited one scanline at a time by a single DRAW_PPU command.
+ * everything is written through ppu_write, ppu_write_map and ppu_set_sprite, which collect
+ * the screen area the change touches: the cell of a map write, the old and the new place of
+ * a sprite and the whole screen for a register. draw_ppu hands that area to the draw command
+ * diff, the command itself stays the same from frame to frame */
+#define PPU_MAP_SIZE 32
+#define PPU_MAP_PX   (PPU_MAP_SIZE * TILE_SIZE)
+#define PPU_OAM_CAP  40
+#define PPU_LCDC_BG      (1 << 0)
+#define PPU_LCDC_WINDOW  (1 << 1)
+#define PPU_LCDC_SPRITES (1 << 2)
+#define PPU_SPRITE_HIDDEN    (1 << 0)
+#define PPU_SPRITE_FLIP_X    (1 << 1)
+#define PPU_SPRITE_FLIP_Y    (1 << 2)
+#define PPU_SPRITE_BEHIND_BG (1 << 3)
+typedef struct {
+  s16 x, y;
+  u8 tile;
+  u8 flags;
+} ppu_sprite;
 
-#define ARROWS_CAP 10
 typedef struct {
-  direction dir;
-  s32 x, y;
-  b8 collected;
-} arrow;
-arrow arrows[ARROWS_CAP];
-u32 arrows_amount;
+  u8 lcdc;
+  u8 scx, scy;
+  u8 wx, wy; /* window top-left corner on the screen */
+  u8 bg_map[PPU_MAP_SIZE * PPU_MAP_SIZE];
+  u8 window_map[PPU_MAP_SIZE * PPU_MAP_SIZE];
+  ppu_sprite oam[PPU_OAM_CAP]; /* lower indices are drawn on top */
+  s32 dirty_x_min, dirty_y_min, dirty_x_max, dirty_y_max; /* on the screen, inclusive */
+} ppu_state;
+ppu_state ppu;
 
-#define PLAYER_SPEED 80
+void
+ppu_dirty(s32 x_min, s32 y_min, s32 x_max, s32 y_max) {
+  if (x_min < 0) x_min = 0;
+  if (y_min < 0) y_min = 0;
+  if (x_max > GAME_W - 1) x_max = GAME_W - 1;
+  if (y_max > GAME_H - 1) y_max = GAME_H - 1;
+  if (x_min > x_max || y_min > y_max) return;
+  if (x_min < ppu.dirty_x_min) ppu.dirty_x_min = x_min;
+  if (y_min < ppu.dirty_y_min) ppu.dirty_y_min = y_min;
+  if (x_max > ppu.dirty_x_max) ppu.dirty_x_max = x_max;
+  if (y_max > ppu.dirty_y_max) ppu.dirty_y_max = y_max;
+}
 
-#define LVL_MAX_W 20
-#define LVL_MAX_H 18
+#define ppu_dirty_tile(X, Y) ppu_dirty((X), (Y), (X) + TILE_SIZE - 1, (Y) + TILE_SIZE - 1)
+#define ppu_dirty_sprite(S)  do { if (!((S)->flags & PPU_SPRITE_HIDDEN)) ppu_dirty_tile((S)->x, (S)->y); } while (0)
 
-#define TRANSITION_SPEED 0.2f
+/* for the registers, they move or switch whole layers */
+#define ppu_write(FIELD, VALUE) do {\
+  if ((FIELD) != (VALUE)) {\
+    (FIELD) = (VALUE);\
+    ppu_dirty(0, 0, GAME_W - 1, GAME_H - 1);\
+  }\
+} while (0)
 
-transition end_level;
-transition begin_level;
-f32 transition_timer;
-u32 current_level;
-level levels[] = {
-  {
-    0, 0,
-    20, 18,
-    {
-      "WHEN EVERYTHING",
-      "SEEMS ABOUT TO",
-      "COLAPSE",
-      0
-    },
-    "...................."
-    "...................."
-    "...................."
-    ".............k......"
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    ".........p.........."
-    ".............v......"
-    "...................."
-    "...................."
-    "....d..............."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-  },
-  {
-    1, 1,
-    18, 16,
-    {
-      "WHEN YOU LOOK",
-      "AROUND AND ALL",
-      "YOU SEE ARE CORNERS",
-      0
-    },
-    ".................."
-    ".................."
-    ".................."
-    ".....d............"
-    ".................."
-    ".................."
-    "..............k..."
-    ".................."
-    ".................."
-    ".........p........"
-    ".................."
-    ".................."
-    ".................."
-    ".................."
-    ".................."
-    ".................."
-  },
-  {
-    0, 0,
-    20, 18,
-    {
-      "THE FEELING OF",
-      "COMPLETE",
-      "CLAUSTROPHOBIA",
-      "IS WHAT DRIVES",
-      "YOU CRAZY"
-    },
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...........k........"
-    "...................."
-    "...................."
-    "...................."
-    ".........p.........."
-    "...................."
-    "...................."
-    "....d..............."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-  },
-  {
-    0, 0,
-    20, 18,
-    {
-      "YOU NEED TO GET OUT",
-      0
-    },
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...........k........"
-    "...................."
-    "...................."
-    "...................."
-    ".........p.........."
-    "...................."
-    "...................."
-    "....d..............."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-  },
-  {
-    0, 0,
-    20, 18,
-    {
-      "OUT OF THE MADNESS",
-      "OUT OF THIS PLANE",
-      "OUT OF YOUR HEAD",
-      0
-    },
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...........k........"
-    "...................."
-    "...................."
-    "...................."
-    ".........p.........."
-    "...................."
-    "...................."
-    "....d..............."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-  },
-  {
-    0, 0,
-    20, 18,
-    {
-      "BUT YOU CAN'T...",
-      0
-    },
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...........k........"
-    "...................."
-    "...................."
-    "...................."
-    ".........p.........."
-    "...................."
-    "...................."
-    "....d..............."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-  },
-  {
-    0, 0,
-    20, 18,
-    {
-      "BUT I CAN'T...",
-      0
-    },
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    "................k..."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-    ".........p.........."
-    "...................."
-    "...................."
-    "...................."
-    "....d..............."
-    "...................."
-    "...................."
-    "...................."
-    "...................."
-  },
-};
-u32 levels_begin_txt_lines_amount[sizeof (levels) / sizeof (level)];
-s32 levels_begin_txt_x[sizeof (levels) / sizeof (level)][BEGIN_TXT_LINES_CAP];
-s32 levels_begin_txt_y[sizeof (levels) / sizeof (level)][BEGIN_TXT_LINES_CAP];
+void
+ppu_write_map(u8 *map, u32 i, u8 tile) {
+  s32 x = (i % PPU_MAP_SIZE) * TILE_SIZE, y = (i / PPU_MAP_SIZE) * TILE_SIZE;
+  if (map[i] == tile) return;
+  map[i] = tile;
+  if (map == ppu.window_map) {
+    ppu_dirty_tile(x + ppu.wx, y + ppu.wy);
+    return;
+  }
+  /* the background wraps, a cell at the end of the map also shows at the start of the screen */
+  x = (x - ppu.scx) & (PPU_MAP_PX - 1);
+  y = (y - ppu.scy) & (PPU_MAP_PX - 1);
+  ppu_dirty_tile(x, y);
+  ppu_dirty_tile(x - PPU_MAP_PX, y);
+  ppu_dirty_tile(x, y - PPU_MAP_PX);
+  ppu_dirty_tile(x - PPU_MAP_PX, y - PPU_MAP_PX);
+}
 
 void
-add_arrow(direction dir, s32 x, s32 y) {
-  if (arrows_amount == ARROWS_CAP) return;
-  arrows[arrows_amount].x         = x;
-  arrows[arrows_amount].y         = y;
-  arrows[arrows_amount].dir       = dir;
-  arrows[arrows_amount].collected = 0;
-  arrows_amount++;
+ppu_set_sprite(u32 i, s32 x, s32 y, u32 tile, u8 flags) {
+  ppu_sprite *spr = &ppu.oam[i];
+  if (spr->x == x && spr->y == y && spr->tile == tile && spr->flags == flags) return;
+  ppu_dirty_sprite(spr);
+  spr->x     = x;
+  spr->y     = y;
+  spr->tile  = tile;
+  spr->flags = flags;
+  ppu_dirty_sprite(spr);
 }
 
 void
-load_level(u32 level_idx) {
-  u32 cx, cy;
-  player_walking = 0;
-  player_dir = 0;
-  key_collected = 0;
-  arrows_amount = 0;
-  level_x_min = levels[level_idx].x * TILE_SIZE;
-  level_y_min = levels[level_idx].y * TILE_SIZE;
-  level_x_max = (levels[level_idx].x + levels[level_idx].w) * TILE_SIZE;
-  level_y_max = (levels[level_idx].y + levels[level_idx].h) * TILE_SIZE;
-  level_nx_min = level_x_min;
-  level_ny_min = level_y_min;
-  level_nx_max = level_x_max;
-  level_ny_max = level_y_max;
-  for (cy = 0; cy < levels[level_idx].w; cy++) {
-    for (cx = 0; cx < levels[level_idx].h; cx++) {
-      s32 x = (cx + levels[level_idx].x) * TILE_SIZE;
-      s32 y = (cy + levels[level_idx].y) * TILE_SIZE ;
-      switch (levels[level_idx].map[cy * levels[level_idx].w + cx]) {
-        case 'p':
-          player_x = x;
-          player_y = y;
-          player_nx = player_x;
-          player_ny = player_y;
-          break;
-        case 'd':
-          door_x = x;
-          door_y = y;
-          break;
-        case 'k':
-          key_x = x;
-          key_y = y;
-          break;
-        case '^':
-          add_arrow(D_UP, x, y);
-          break;
-        case '<':
-          add_arrow(D_LEFT, x, y);
-          break;
-        case '>':
-          add_arrow(D_RIGHT, x, y);
-          break;
-        case 'v':
-          add_arrow(D_DOWN, x, y);
-          break;
+ppu_reset(void) {
+  u32 i;
+  memset(&ppu, 0, sizeof (ppu));
+  ppu.lcdc = PPU_LCDC_SPRITES;
+  for (i = 0; i < PPU_OAM_CAP; i++) ppu.oam[i].flags = PPU_SPRITE_HIDDEN;
+  ppu.dirty_x_min = 0;
+  ppu.dirty_y_min = 0;
+  ppu.dirty_x_max = GAME_W - 1;
+  ppu.dirty_y_max = GAME_H - 1;
+}
+
+/* color index of a map pixel, or TRANSPARENT */
+#define ppu_map_pixel(MAP, MX, MY) ppu_tile_pixel((MAP)[((MY) >> 3) * PPU_MAP_SIZE + ((MX) >> 3)], (MX) & 7, (MY) & 7)
+u8
+ppu_tile_pixel(u32 tile, u32 ox, u32 oy) {
+  u32 bit = 7 - ox;
+  if (!((atlas_mask[tile * TILE_SIZE + oy] >> bit) & 1)) return TRANSPARENT;
+  return ((atlas[tile * TILE_SIZE * 2 + oy * 2] >> bit) & 1) | (((atlas[tile * TILE_SIZE * 2 + oy * 2 + 1] >> bit) & 1) << 1);
+}
+
+void
+raster_ppu(const clip_rect *clip) {
+  s32 x, y, i;
+  u8 line[GAME_W];
+  u8 visible[PPU_OAM_CAP];
+  u32 visible_amount = 0;
+  /* oam scan, once per call */
+  if (ppu.lcdc & PPU_LCDC_SPRITES) {
+    for (i = PPU_OAM_CAP - 1; i >= 0; i--) {
+      ppu_sprite *spr = &ppu.oam[i];
+      if (spr->flags & PPU_SPRITE_HIDDEN) continue;
+      if (spr->x + TILE_SIZE <= clip->x_min || spr->x > clip->x_max ||
+          spr->y + TILE_SIZE <= clip->y_min || spr->y > clip->y_max) continue;
+      visible[visible_amount++] = i;
+    }
+  }
+  for (y = clip->y_min; y <= clip->y_max; y++) {
+    u8 *dst = &screen[y * GAME_W];
+    b8 window_line = (ppu.lcdc & PPU_LCDC_WINDOW) && y >= ppu.wy;
+    /* background and window */
+    for (x = clip->x_min; x <= clip->x_max; x++) {
+      line[x] = TRANSPARENT;
+      if (window_line && x >= ppu.wx) {
+        line[x] = ppu_map_pixel(ppu.window_map, (u32)(x - ppu.wx), (u32)(y - ppu.wy));
+      } else if (ppu.lcdc & PPU_LCDC_BG) {
+        line[x] = ppu_map_pixel(ppu.bg_map, (u32)(x + ppu.scx) & 0xff, (u32)(y + ppu.scy) & 0xff);
+      }
+      if (line[x] != TRANSPARENT) dst[x] = line[x];
+    }
+    /* sprites, back to front */
+    for (i = 0; i < (s32)visible_amount; i++) {
+      ppu_sprite *spr = &ppu.oam[visible[i]];
+      s32 oy = y - spr->y;
+      if (oy < 0 || oy >= TILE_SIZE) continue;
+      if (spr->flags & PPU_SPRITE_FLIP_Y) oy = TILE_SIZE - 1 - oy;
+      for (x = spr->x < clip->x_min ? clip->x_min : spr->x; x < spr->x + TILE_SIZE && x <= clip->x_max; x++) {
+        s32 ox = spr->flags & PPU_SPRITE_FLIP_X ? TILE_SIZE - 1 - (x - spr->x) : x - spr->x;
+        u8 c = ppu_tile_pixel(spr->tile, ox, oy);
+        if (c == TRANSPARENT) continue;
+        if ((spr->flags & PPU_SPRITE_BEHIND_BG) && line[x] != TRANSPARENT && line[x] != WHITE) continue;
+        dst[x] = c;
       }
     }
   }
-  current_level = level_idx;
-  reset_drawing_bounds();
 }
 
+/* draw calls are recorded and diffed against the ones from the previous frame,
+ * only the area where they differ gets rasterized and uploaded */
+typedef enum {
+  DRAW_RECT = 0,
+  DRAW_TILE,
+  DRAW_TEXT_RUN,
+  DRAW_PPU
+} draw_cmd_type;
+
+typedef struct {
+  s32 type;
+  s32 x, y;
+  s32 a, b; /* rect: color index, unused. tile: tile_x, tile_y. text run: run, generation. ppu: unused */
+  s32 x_min, y_min, x_max, y_max; /* touched area, inclusive */
+} draw_cmd;
+
+#define DRAW_CMDS_CAP 2048
+draw_cmd draw_cmds[2][DRAW_CMDS_CAP];
+u32 draw_cmds_amount[2];
+u32 draw_cmds_cur;
+s32 dirty_x_min, dirty_y_min, dirty_x_max, dirty_y_max;
+/* what retained layers changed under commands that stayed the same, added to the next diff */
+s32 retained_x_min = GAME_W, retained_y_min = GAME_H, retained_x_max = -1, retained_y_max = -1;
+const draw_cmd *raster_cmds; /* the commands being rasterized */
+/* the commands that touch each band of the dirty rect, in drawing order */
+#define RASTER_BANDS ((GAME_H + RASTER_BAND_H - 1) / RASTER_BAND_H)
+u16 raster_bins[RASTER_BANDS][DRAW_CMDS_CAP];
+u32 raster_bins_amount[RASTER_BANDS];
+
+u8 draw_cmds_spilled; /* frames left to rasterize whole since the buffer ran out */
+
+void spill_draw_cmds(void);
+
 void
-init(void) {
+push_draw_cmd(s32 type, s32 x, s32 y, s32 a, s32 b, s32 x_min, s32 y_min, s32 x_max, s32 y_max) {
+  draw_cmd *cmd;
+  if (x_min > x_max || y_min > y_max) return;
+  if (draw_cmds_amount[draw_cmds_cur] == DRAW_CMDS_CAP) spill_draw_cmds();
+  cmd = &draw_cmds[draw_cmds_cur][draw_cmds_amount[draw_cmds_cur]++];
+  cmd->type  = type;
+  cmd->x     = x;
+  cmd->y     = y;
+  cmd->a     = a;
+  cmd->b     = b;
+  cmd->x_min = x_min;
+  cmd->y_min = y_min;
+  cmd->x_max = x_max;
+  cmd->y_max = y_max;
+}
+
+void
+clear_screen(u8 color_index) {
+  push_draw_cmd(DRAW_RECT, 0, 0, color_index, 0, 0, 0, GAME_W - 1, GAME_H - 1);
+}
+
+void
+draw_rect(s32 x_min, s32 y_min, s32 x_max, s32 y_max, u8 color_index) {
+  x_min -= camera_x;
+  y_min -= camera_y;
+  x_max -= camera_x + 1;
+  y_max -= camera_y + 1;
+  if (x_min < bound_x_min) x_min = bound_x_min;
+  if (y_min < bound_y_min) y_min = bound_y_min;
+  if (x_max > bound_x_max) x_max = bound_x_max;
+  if (y_max > bound_y_max) y_max = bound_y_max;
+  push_draw_cmd(DRAW_RECT, x_min, y_min, color_index, 0, x_min, y_min, x_max, y_max);
+}
+
+void
+draw_tile(s32 x, s32 y, u32 tile_x, u32 tile_y) {
+  if (tile_x >= ATLAS_TW || tile_y * ATLAS_TW + tile_x >= atlas_tiles) return;
+  x -= camera_x;
+  y -= camera_y;
+  if (x + TILE_SIZE <= bound_x_min || x > bound_x_max || y + TILE_SIZE <= bound_y_min || y > bound_y_max) return;
+  push_draw_cmd(DRAW_TILE, x, y, tile_x, tile_y,
+      x < bound_x_min ? bound_x_min : x,
+      y < bound_y_min ? bound_y_min : y,
+      x + TILE_SIZE - 1 > bound_x_max ? bound_x_max : x + TILE_SIZE - 1,
+      y + TILE_SIZE - 1 > bound_y_max ? bound_y_max : y + TILE_SIZE - 1);
+}
+
+void
+add_dirty_rect(s32 x_min, s32 y_min, s32 x_max, s32 y_max) {
+  if (x_min < dirty_x_min) dirty_x_min = x_min;
+  if (y_min < dirty_y_min) dirty_y_min = y_min;
+  if (x_max > dirty_x_max) dirty_x_max = x_max;
+  if (y_max > dirty_y_max) dirty_y_max = y_max;
+}
+
+/* adds the part of a's area outside of b's, as up to four strips */
+void
+add_dirty_outside(const draw_cmd *a, const draw_cmd *b) {
+  s32 x_min = a->x_min > b->x_min ? a->x_min : b->x_min;
+  s32 x_max = a->x_max < b->x_max ? a->x_max : b->x_max;
+  if (a->x_min < b->x_min) add_dirty_rect(a->x_min, a->y_min, b->x_min - 1 < a->x_max ? b->x_min - 1 : a->x_max, a->y_max);
+  if (a->x_max > b->x_max) add_dirty_rect(b->x_max + 1 > a->x_min ? b->x_max + 1 : a->x_min, a->y_min, a->x_max, a->y_max);
+  if (x_min > x_max) return;
+  if (a->y_min < b->y_min) add_dirty_rect(x_min, a->y_min, x_max, b->y_min - 1 < a->y_max ? b->y_min - 1 : a->y_max);
+  if (a->y_max > b->y_max) add_dirty_rect(x_min, b->y_max + 1 > a->y_min ? b->y_max + 1 : a->y_min, x_max, a->y_max);
+}
+
+/* files every command that touches the dirty rect under the bands it spans */
+void
+raster_bin_cmds(u32 amount) {
+  u32 i, band;
+  for (band = dirty_y_min / RASTER_BAND_H; band <= (u32)dirty_y_max / RASTER_BAND_H; band++) raster_bins_amount[band] = 0;
+  for (i = 0; i < amount; i++) {
+    const draw_cmd *cmd = &raster_cmds[i];
+    s32 y_min = cmd->y_min < dirty_y_min ? dirty_y_min : cmd->y_min;
+    s32 y_max = cmd->y_max > dirty_y_max ? dirty_y_max : cmd->y_max;
+    if (cmd->x_min > dirty_x_max || cmd->x_max < dirty_x_min || y_min > y_max) continue;
+    for (band = y_min / RASTER_BAND_H; band <= (u32)y_max / RASTER_BAND_H; band++) raster_bins[band][raster_bins_amount[band]++] = i;
+  }
+}
+
+/* every command of the band is clipped to the dirty rect and to the band, the bands don't
+ * overlap so they can be rasterized in any order and on any thread with the same result */
+void
+raster_band(u32 band) {
   u32 i;
-  end_level.is_happening = 1;
-  end_level.fade_state = FADE_IN;
-  begin_level.is_happening = 0;
-  begin_level.fade_state = 0;
-  transition_timer = 0;
-  current_level = 0;
-  grow_level = 0;
-  for (i = 0; i < COLORS_AMOUNT; i++) palette[i] = colors[BLACK];
-  for (i = 0; i < sizeof (levels) / sizeof (level); i++) {
-    u32 j;
-    u32 begin_txt_y;
-    levels_begin_txt_lines_amount[i] = 0;
-    for (j = 0; j < BEGIN_TXT_LINES_CAP; j++) {
-      if (!levels[i].begin_txt[j]) break;
-      levels_begin_txt_lines_amount[i]++;
-    }
-    begin_txt_y = (GAME_H >> 1) - ((levels_begin_txt_lines_amount[i] * TILE_SIZE) >> 1);
-    for (j = 0; j < levels_begin_txt_lines_amount[i]; j++) {
-      levels_begin_txt_x[i][j] = (GAME_W >> 1) - ((strlen(levels[i].begin_txt[j]) * TILE_SIZE) >> 1);
-      levels_begin_txt_y[i][j] = begin_txt_y;
-      begin_txt_y += TILE_SIZE;
+  clip_rect clip;
+  s32 y_min = band * RASTER_BAND_H, y_max = y_min + RASTER_BAND_H - 1;
+  if (y_min < dirty_y_min) y_min = dirty_y_min;
+  if (y_max > dirty_y_max) y_max = dirty_y_max;
+  for (i = 0; i < raster_bins_amount[band]; i++) {
+    const draw_cmd *cmd = &raster_cmds[raster_bins[band][i]];
+    clip.x_min = cmd->x_min < dirty_x_min ? dirty_x_min : cmd->x_min;
+    clip.y_min = cmd->y_min < y_min       ? y_min       : cmd->y_min;
+    clip.x_max = cmd->x_max > dirty_x_max ? dirty_x_max : cmd->x_max;
+    clip.y_max = cmd->y_max > y_max       ? y_max       : cmd->y_max;
+    if (clip.x_min > clip.x_max || clip.y_min > clip.y_max) continue;
+    switch (cmd->type) {
+      case DRAW_RECT: raster_rect(&clip, cmd->a); break;
+      case DRAW_TILE: raster_tile(&clip, cmd->x, cmd->y, cmd->a, cmd->b); break;
+      case DRAW_TEXT_RUN: raster_text_run(&clip, cmd->x, cmd->y, cmd->a); break;
+      case DRAW_PPU: raster_ppu(&clip); break;
     }
   }
-  reset_drawing_bounds();
 }
 
+#if RASTER_THREADS > 1
+/* the pool threads and the caller take bands from raster_band_next until they run out */
+volatile u32 raster_band_next;
+u32 raster_band_end;
+sem_t raster_start, raster_done;
+pthread_t raster_threads[RASTER_THREADS - 1];
+
 void
-player_setup_movement(direction next_dir, s32 add_to_nx, s32 add_to_ny,
-    b8 shrink_level_x_min, b8 shrink_level_y_min, b8 shrink_level_x_max, b8 shrink_level_y_max) {
-  player_nx = player_x + add_to_nx;
-  player_ny = player_y + add_to_ny;
-  if (rect_collide(player_nx, player_ny, player_nx + TILE_SIZE, player_ny + TILE_SIZE, level_x_min, level_y_min, level_x_max, level_y_max) &&
-    (key_collected || (player_nx != door_x || player_ny != door_y))) {
-    player_dir = next_dir;
-    player_walking = 1;
-    level_nx_min = level_x_min + TILE_SIZE * shrink_level_x_min;
-    level_ny_min = level_y_min + TILE_SIZE * shrink_level_y_min;
-    level_nx_max = level_x_max - TILE_SIZE * shrink_level_x_max;
-    level_ny_max = level_y_max - TILE_SIZE * shrink_level_y_max;
+raster_take_bands(void) {
+  u32 band;
+  while ((band = __sync_fetch_and_add(&raster_band_next, 1)) < raster_band_end) raster_band(band);
+}
+
+void *
+raster_worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    sem_wait(&raster_start);
+    raster_take_bands();
+    sem_post(&raster_done);
   }
+  return 0;
 }
 
 void
-player_move(b8 condition, f32 dt, s32 sign_x, s32 sign_y,
-    b8 shrink_level_x_min, b8 shrink_level_y_min, b8 shrink_level_x_max, b8 shrink_level_y_max) {
-  if (condition) {
+init_raster_threads(void) {
+  u32 i;
+  sem_init(&raster_start, 0, 0);
+  sem_init(&raster_done, 0, 0);
+  for (i = 0; i < RASTER_THREADS - 1; i++) pthread_create(&raster_threads[i], 0, raster_worker, 0);
+}
+#else
+#define init_raster_threads() ((void)0)
+#endif
+
+void
+raster_dirty_bands(void) {
+  u32 band, band_first = dirty_y_min / RASTER_BAND_H, band_last = dirty_y_max / RASTER_BAND_H;
+#if RASTER_THREADS > 1
+  /* waking the pool isn't worth it for a single band */
+  if (band_first != band_last) {
     u32 i;
-    player_y = player_ny;
-    player_x = player_nx;
-    player_walking = 0;
-    level_x_min = level_nx_min;
-    level_y_min = level_ny_min;
-    level_x_max = level_nx_max;
-    level_y_max = level_ny_max;
-    if (key_collected) {
-      if (player_x == door_x && player_y == door_y) {
-        end_level.is_happening = 1;
-        transition_timer = 0;
-      }
-    } else if (player_x == key_x && player_y == key_y) {
-      key_collected = 1;
-    }
-    for (i = 0; i < arrows_amount; i++) {
-      if (arrows[i].collected) continue;
-      if (player_x == arrows[i].x && player_y == arrows[i].y) {
-        arrows[i].collected = 1;
-        grow_level_dir = arrows[i].dir;
-        switch (arrows[i].dir) {
-          case D_UP:
-            level_ny_min = level_y_min - TILE_SIZE;
-            grow_level = 1;
-            break;
-          case D_LEFT:
-            level_nx_min = level_x_min - TILE_SIZE;
-            grow_level = 1;
-            break;
-          case D_RIGHT:
-            level_nx_max = level_x_max + TILE_SIZE;
-            grow_level = 1;
-            break;
-          case D_DOWN:
-            level_ny_max = level_y_max + TILE_SIZE;
-            grow_level = 1;
-            break;
-        }
-      }
-    }
-  } else {
-    f32 delta_move = PLAYER_SPEED * dt;
-    player_x += delta_move * sign_x;
-    player_y += delta_move * sign_y;
-    level_x_min += delta_move * shrink_level_x_min;
-    level_y_min += delta_move * shrink_level_y_min;
-    level_x_max -= delta_move * shrink_level_x_max;
-    level_y_max -= delta_move * shrink_level_y_max;
+    raster_band_next = band_first;
+    raster_band_end  = band_last + 1;
+    for (i = 0; i < RASTER_THREADS - 1; i++) sem_post(&raster_start);
+    raster_take_bands();
+    for (i = 0; i < RASTER_THREADS - 1; i++) sem_wait(&raster_done);
+    return;
   }
+#endif
+  for (band = band_first; band <= band_last; band++) raster_band(band);
+}
+
+/* a frame with more than DRAW_CMDS_CAP commands is rasterized whole a full buffer at a time,
+ * and so is the next one since the list it gets diffed against only has the last commands */
+void
+spill_draw_cmds(void) {
+  dirty_x_min = 0;
+  dirty_y_min = 0;
+  dirty_x_max = GAME_W - 1;
+  dirty_y_max = GAME_H - 1;
+  raster_cmds = draw_cmds[draw_cmds_cur];
+  raster_bin_cmds(DRAW_CMDS_CAP);
+  raster_dirty_bands();
+  draw_cmds_amount[draw_cmds_cur] = 0;
+  draw_cmds_spilled = 2;
 }
 
+/* returns 0 when the frame is identical to the previous one */
 b8
-fade_out(void) {
-  if (palette[WHITE] == colors[WHITE]) {
-    palette[WHITE]      = colors[LIGHT_GRAY];
-    palette[LIGHT_GRAY] = colors[DARK_GRAY];
-    palette[DARK_GRAY]  = colors[BLACK];
-  } else if (palette[WHITE] == colors[LIGHT_GRAY]) {
-    palette[WHITE]      = colors[DARK_GRAY];
-    palette[LIGHT_GRAY] = colors[BLACK];
-  } else if (palette[WHITE] == colors[DARK_GRAY]) {
-    palette[WHITE]      = colors[BLACK];
-  } else if (palette[WHITE] == colors[BLACK]) {
-    return 1;
+flush_draw_cmds(void) {
+  u32 i;
+  draw_cmd *cur = draw_cmds[draw_cmds_cur];
+  draw_cmd *prv = draw_cmds[!draw_cmds_cur];
+  u32 cur_amount = draw_cmds_amount[draw_cmds_cur];
+  u32 prv_amount = draw_cmds_amount[!draw_cmds_cur];
+  dirty_x_min = retained_x_min;
+  dirty_y_min = retained_y_min;
+  dirty_x_max = retained_x_max;
+  dirty_y_max = retained_y_max;
+  retained_x_min = GAME_W;
+  retained_y_min = GAME_H;
+  retained_x_max = -1;
+  retained_y_max = -1;
+  for (i = 0; i < cur_amount || i < prv_amount; i++) {
+    if (i < cur_amount && i < prv_amount && !memcmp(&cur[i], &prv[i], sizeof (draw_cmd))) continue;
+    /* a rect or the ppu layer that only moved its bounds looks the same where both cover */
+    if (i < cur_amount && i < prv_amount && cur[i].type == prv[i].type && cur[i].a == prv[i].a &&
+        (cur[i].type == DRAW_RECT || cur[i].type == DRAW_PPU)) {
+      add_dirty_outside(&cur[i], &prv[i]);
+      add_dirty_outside(&prv[i], &cur[i]);
+      continue;
+    }
+    if (i < cur_amount) add_dirty_rect(cur[i].x_min, cur[i].y_min, cur[i].x_max, cur[i].y_max);
+    if (i < prv_amount) add_dirty_rect(prv[i].x_min, prv[i].y_min, prv[i].x_max, prv[i].y_max);
   }
-  return 0;
+  if (draw_cmds_spilled) {
+    draw_cmds_spilled--;
+    dirty_x_min = 0;
+    dirty_y_min = 0;
+    dirty_x_max = GAME_W - 1;
+    dirty_y_max = GAME_H - 1;
+  }
+  draw_cmds_cur = !draw_cmds_cur;
+  draw_cmds_amount[draw_cmds_cur] = 0;
+  if (dirty_x_min > dirty_x_max) return 0;
+  raster_cmds = cur;
+  raster_bin_cmds(cur_amount);
+  raster_dirty_bands();
+  return 1;
 }
 
-b8
-fade_in(void) {
-  if (palette[WHITE] == colors[BLACK]) {
-    palette[WHITE]      = colors[DARK_GRAY];
-  } else if (palette[WHITE] == colors[DARK_GRAY]) {
-    palette[WHITE]      = colors[LIGHT_GRAY];
-    palette[LIGHT_GRAY] = colors[DARK_GRAY];
-  } else if (palette[WHITE] == colors[LIGHT_GRAY]) {
-    palette[WHITE]      = colors[WHITE];
-    palette[LIGHT_GRAY] = colors[LIGHT_GRAY];
-    palette[DARK_GRAY]  = colors[DARK_GRAY];
-  } else if (palette[WHITE] == colors[WHITE]) {
-    return 1;
+void
+draw_string(s32 x, s32 y, const s8 *str) {
+  for (; *str; str++, x += TILE_SIZE) {
+    u16 tile = glyph_tiles[(u8)*str];
+    if (tile != GLYPH_SKIP) draw_tile(x, y, tile % ATLAS_TW, tile / ATLAS_TW);
   }
-  return 0;
 }
 
 void
-update(f32 dt) {
-  /* level transitions */
-  if (begin_level.is_happening) {
-    if (begin_level.fade_state == FADE_NONE) {
-      if (key_click(K_START)) begin_level.fade_state = FADE_OUT;
-    } else {
-      if (transition_timer < TRANSITION_SPEED) {
-        transition_timer += dt;
-      } else {
-        transition_timer = 0;
-        switch (begin_level.fade_state) {
-          case FADE_OUT:
-            if (fade_out()) {
-              begin_level.fade_state = FADE_IN;
-              load_level(current_level);
-            }
-            break;
-          case FADE_IN:
-            if (fade_in()) {
-              begin_level.fade_state = FADE_NONE;
-              begin_level.is_happening = 0;
-            }
-            break;
-          default: break;
-        }
-      }
-    }
-    return;
-  } else if (end_level.is_happening) {
-    if (transition_timer < TRANSITION_SPEED) {
-      transition_timer += dt;
-    } else {
-      transition_timer = 0;
-      switch (end_level.fade_state) {
-        case FADE_OUT:
-          if (fade_out()) {
-            end_level.fade_state = FADE_IN;
-            current_level++;
+draw_text(s32 x, s32 y, s8 *fmt, ...) {
+  s8 txt[128];
+  va_list args;
+  va_start(args, fmt);
+  vsprintf(txt, fmt, args);
+  va_end(args);
+  draw_string(x, y, txt);
+}
+
+/* returns -1 when the run doesn't fit in the cache, draw it with draw_string then */
+s32
+cache_text_run(const s8 *str) {
+  u32 i, c, oy, len = strlen(str);
+  text_run *run;
+  if (text_runs_amount == TEXT_RUNS_CAP || !len) return -1;
+  if (text_runs_arena_used + len * TILE_SIZE * TILE_SIZE > TEXT_RUNS_ARENA_SZ) return -1;
+  run = &text_runs[text_runs_amount];
+  run->w = len * TILE_SIZE;
+  run->offset = text_runs_arena_used;
+  text_runs_arena_used += len * TILE_SIZE * TILE_SIZE;
+  for (c = 0; c < len; c++) {
+    u16 tile = glyph_tiles[(u8)str[c]];
+    for (oy = 0; oy < TILE_SIZE; oy++) {
+      u8 *dst  = &text_runs_pixels[run->offset + oy * run->w + c * TILE_SIZE];
+      u8 *mask = &text_runs_mask[run->offset + oy * run->w + c * TILE_SIZE];
+      tile_row row;
+      if (tile == GLYPH_SKIP) {
+        memset(mask, 0, TILE_SIZE);
+        continue;
+      }
+      decode_tile_row(row, atlas[tile * TILE_SIZE * 2 + oy * 2], atlas[tile * TILE_SIZE * 2 + oy * 2 + 1]);
+      for (i = 0; i < TILE_SIZE; i++) {
+        dst[i]  = row.px[i];
+        mask[i] = plane_lut[atlas_mask[tile * TILE_SIZE + oy]].px[i] ? 0xff : 0;
+      }
+    }
+  }
+  return text_runs_amount++;
+}
+
+/* composites the ppu layers inside the current drawing bounds, only what the ppu writes
+ * touched inside them since the last call gets redrawn when the bounds stay the same */
+void
+draw_ppu(void) {
+  s32 x_min = ppu.dirty_x_min < bound_x_min ? bound_x_min : ppu.dirty_x_min;
+  s32 y_min = ppu.dirty_y_min < bound_y_min ? bound_y_min : ppu.dirty_y_min;
+  s32 x_max = ppu.dirty_x_max > bound_x_max ? bound_x_max : ppu.dirty_x_max;
+  s32 y_max = ppu.dirty_y_max > bound_y_max ? bound_y_max : ppu.dirty_y_max;
+  push_draw_cmd(DRAW_PPU, 0, 0, 0, 0, bound_x_min, bound_y_min, bound_x_max, bound_y_max);
+  if (x_min <= x_max && y_min <= y_max) {
+    if (x_min < retained_x_min) retained_x_min = x_min;
+    if (y_min < retained_y_min) retained_y_min = y_min;
+    if (x_max > retained_x_max) retained_x_max = x_max;
+    if (y_max > retained_y_max) retained_y_max = y_max;
+  }
+  ppu.dirty_x_min = GAME_W;
+  ppu.dirty_y_min = GAME_H;
+  ppu.dirty_x_max = -1;
+  ppu.dirty_y_max = -1;
+}
+
+void
+clear_text_runs(void) {
+  text_runs_amount = 0;
+  text_runs_arena_used = 0;
+  text_runs_generation++;
+}
+
+void
+draw_text_run(s32 x, s32 y, s32 run) {
+  push_draw_cmd(DRAW_TEXT_RUN, x, y, run, text_runs_generation,
+      x < bound_x_min ? bound_x_min : x,
+      y < bound_y_min ? bound_y_min : y,
+      x + text_runs[run].w - 1 > bound_x_max ? bound_x_max : x + text_runs[run].w - 1,
+      y + TILE_SIZE - 1 > bound_y_max ? bound_y_max : y + TILE_SIZE - 1);
+}
+
+#ifdef PROFILE
+void
+profile_draw_hud(void) {
+  u32 p;
+  draw_rect(0, 0, GAME_W, TILE_SIZE * (PHASES_AMOUNT + 1), BLACK);
+  draw_text(0, 0, "US    MIN  AVG  P99");
+  for (p = 0; p < PHASES_AMOUNT; p++) {
+    u32 s0 = profile_stats[p][0], s1 = profile_stats[p][1], s2 = profile_stats[p][2];
+    draw_text(0, TILE_SIZE * (p + 1), "%s  %4u %4u %4u", profile_phase_labels[p],
+        s0 > 9999 ? 9999 : s0, s1 > 9999 ? 9999 : s1, s2 > 9999 ? 9999 : s2);
+  }
+}
+#endif
+
+/* audio: four channels modeled on the game boy apu, driven through its registers. the simulation
+ * only queues register writes, samples are synthesized on demand by the consumer */
+#define APU_CLOCK 4194304
+typedef enum {
+  NR10 = 0x10, NR11, NR12, NR13, NR14, /* pulse 1: sweep, duty and length, envelope, frequency */
+  NR21 = 0x16, NR22, NR23, NR24,       /* pulse 2 */
+  NR30 = 0x1a, NR31, NR32, NR33, NR34, /* wave: dac, length, output level, frequency */
+  NR41 = 0x20, NR42, NR43, NR44,       /* noise: length, envelope, lfsr clock and width, control */
+  NR50, NR51, NR52,                    /* master volume, panning, power */
+  APU_WAVE_RAM = 0x30,                 /* 32 4 bit samples, high nibble first */
+  APU_REGS_END = 0x40
+} apu_reg;
+#define APU_PULSE1 0
+#define APU_PULSE2 1
+#define APU_WAVE   2
+#define APU_NOISE  3
+#define APU_CHANNELS 4
+#define apu_reg(R)      apu.regs[(R) - NR10]
+#define apu_nr(C, I)    apu_reg(NR10 + (C) * 5 + (I)) /* NRx0 to NRx4 of a channel */
+#define apu_freq(C)     (apu_nr(C, 3) | (apu_nr(C, 4) & 7) << 8)
+#define apu_dac_on(C)   ((C) == APU_WAVE ? apu_reg(NR30) & 0x80 : apu_nr(C, 2) & 0xf8)
+
+typedef struct {
+  b8 on;
+  u8 volume; /* 0-15, moved by the envelope */
+  u8 env_timer;
+  u8 sweep_timer;
+  u16 length; /* 256 hz ticks left while the length is enabled */
+  u16 shadow_freq; /* pulse 1, what the sweep works on */
+  u16 lfsr;
+  u32 phase, phase_step; /* 16.16, in duty steps, wave samples or lfsr clocks */
+} apu_channel;
+
+typedef struct {
+  u8 regs[APU_REGS_END - NR10];
+  apu_channel ch[APU_CHANNELS];
+  u32 sequencer_acc, sequencer_step; /* the 512 hz frame sequencer, in output samples */
+  s32 prv_in, prv_out; /* high-pass like the capacitor on the real output, prv_out has 8 fractional bits */
+} apu_state;
+apu_state apu;
+
+typedef struct {
+  u8 reg, value;
+} apu_cmd;
+
+/* the duty patterns of 12.5, 25, 50 and 75%, msb first */
+u8 apu_duties[4] = { 0x01, 0x81, 0x87, 0x7e };
+u32 apu_noise_divisors[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+u32 apu_wave_shifts[4] = { 4, 0, 1, 2 }; /* mute, 100, 50 and 25% */
+
+/* phase advance per output sample of a timer that ticks every period apu clocks */
+u32
+apu_phase_step(u32 period) {
+  return (u32)((f64)APU_CLOCK / period * 65536.0 / AUDIO_RATE);
+}
+
+void
+apu_update_step(u32 c) {
+  apu_channel *ch = &apu.ch[c];
+  switch (c) {
+    case APU_PULSE1:
+    case APU_PULSE2: ch->phase_step = apu_phase_step((2048 - apu_freq(c)) * 4); break;
+    case APU_WAVE:   ch->phase_step = apu_phase_step((2048 - apu_freq(c)) * 2); break;
+    case APU_NOISE:
+      ch->phase_step = apu_reg(NR43) >> 4 >= 14 ? 0 :
+        apu_phase_step(apu_noise_divisors[apu_reg(NR43) & 7] << (apu_reg(NR43) >> 4));
+      break;
+  }
+}
+
+/* returns the next sweep frequency, it turns the channel off when it overflows */
+u32
+apu_sweep(void) {
+  apu_channel *ch = &apu.ch[APU_PULSE1];
+  u32 delta = ch->shadow_freq >> (apu_reg(NR10) & 7);
+  u32 freq = apu_reg(NR10) & 0x08 ? ch->shadow_freq - delta : ch->shadow_freq + delta;
+  if (freq > 2047) ch->on = 0;
+  return freq;
+}
+
+void
+apu_trigger(u32 c) {
+  apu_channel *ch = &apu.ch[c];
+  ch->on = apu_dac_on(c) != 0;
+  if (!ch->length) ch->length = c == APU_WAVE ? 256 : 64;
+  ch->volume = apu_nr(c, 2) >> 4;
+  ch->env_timer = apu_nr(c, 2) & 7;
+  ch->phase = 0;
+  if (c == APU_NOISE) ch->lfsr = 0x7fff;
+  if (c == APU_PULSE1) {
+    ch->shadow_freq = apu_freq(c);
+    ch->sweep_timer = (apu_reg(NR10) >> 4) & 7 ? (apu_reg(NR10) >> 4) & 7 : 8;
+    if (apu_reg(NR10) & 7) apu_sweep();
+  }
+}
+
+void
+apu_write(u32 reg, u8 value) {
+  u32 c = (reg - NR10) / 5;
+  if (reg < NR10 || reg >= APU_REGS_END) return;
+  if (!(apu_reg(NR52) & 0x80) && reg != NR52 && reg < APU_WAVE_RAM) return;
+  apu_reg(reg) = value;
+  if (reg >= NR50) return;
+  switch ((reg - NR10) % 5) {
+    case 1: apu.ch[c].length = c == APU_WAVE ? 256 - value : 64 - (value & 63); break;
+    case 2:
+      if (!apu_dac_on(c)) apu.ch[c].on = 0;
+      break;
+    case 4:
+      apu_update_step(c);
+      if (value & 0x80) apu_trigger(c);
+      break;
+    default:
+      if (reg == NR30 && !apu_dac_on(c)) apu.ch[c].on = 0;
+      apu_update_step(c);
+      break;
+  }
+}
+
+void
+apu_play(const apu_cmd *cmds, u32 amount) {
+  u32 i;
+  for (i = 0; i < amount; i++) apu_write(cmds[i].reg, cmds[i].value);
+}
+
+void
+apu_reset(void) {
+  static const apu_cmd power_on[] = { { NR52, 0x80 }, { NR50, 0x77 }, { NR51, 0xff } };
+  u32 i;
+  memset(&apu, 0, sizeof (apu));
+  apu_play(power_on, sizeof (power_on) / sizeof (apu_cmd));
+  /* a triangle */
+  for (i = 0; i < 16; i++) apu_write(APU_WAVE_RAM + i, i < 8 ? (i * 2) << 4 | (i * 2 + 1) : (31 - i * 2) << 4 | (30 - i * 2));
+}
+
+/* length at 256 hz, sweep at 128 hz and envelopes at 64 hz */
+void
+apu_sequencer_tick(void) {
+  u32 c, step = apu.sequencer_step++ & 7;
+  for (c = 0; c < APU_CHANNELS; c++) {
+    apu_channel *ch = &apu.ch[c];
+    if (!(step & 1) && (apu_nr(c, 4) & 0x40) && ch->length && !--ch->length) ch->on = 0;
+    if (step == 7 && c != APU_WAVE && (apu_nr(c, 2) & 7) && !--ch->env_timer) {
+      ch->env_timer = apu_nr(c, 2) & 7;
+      if (apu_nr(c, 2) & 0x08 ? ch->volume < 15 : ch->volume > 0) ch->volume += apu_nr(c, 2) & 0x08 ? 1 : -1;
+    }
+  }
+  if ((step == 2 || step == 6) && apu.ch[APU_PULSE1].on && !--apu.ch[APU_PULSE1].sweep_timer) {
+    apu_channel *ch = &apu.ch[APU_PULSE1];
+    u32 period = (apu_reg(NR10) >> 4) & 7;
+    ch->sweep_timer = period ? period : 8;
+    if (period) {
+      u32 freq = apu_sweep();
+      if (ch->on && (apu_reg(NR10) & 7)) {
+        ch->shadow_freq = freq;
+        apu_reg(NR13) = freq & 0xff;
+        apu_reg(NR14) = (apu_reg(NR14) & ~7) | freq >> 8;
+        apu_update_step(APU_PULSE1);
+        apu_sweep();
+      }
+    }
+  }
+}
+
+void
+apu_render(s16 *out, u32 amount) {
+  u32 i, c;
+  b8 heard[APU_CHANNELS];
+  s32 silence = 0, master = apu_reg(NR52) & 0x80 ? ((apu_reg(NR50) & 7) + 1) * 64 : 0;
+  /* the registers only change between batches, a dac that is on and silent is at -15 */
+  for (c = 0; c < APU_CHANNELS; c++) {
+    heard[c] = apu_dac_on(c) && ((apu_reg(NR51) >> c) & 0x11);
+    if (heard[c]) silence -= 15;
+  }
+  for (i = 0; i < amount; i++) {
+    s32 mix = silence, sample;
+    apu.sequencer_acc += 512;
+    if (apu.sequencer_acc >= AUDIO_RATE) {
+      apu.sequencer_acc -= AUDIO_RATE;
+      apu_sequencer_tick();
+    }
+    for (c = 0; c < APU_CHANNELS; c++) {
+      apu_channel *ch = &apu.ch[c];
+      u32 level = 0, clocks;
+      if (!heard[c] || !ch->on) continue;
+      switch (c) {
+        case APU_PULSE1:
+        case APU_PULSE2:
+          level = (apu_duties[apu_nr(c, 1) >> 6] >> (7 - ((ch->phase >> 16) & 7)) & 1) * ch->volume;
+          ch->phase += ch->phase_step;
+          break;
+        case APU_WAVE:
+          level = apu_reg(APU_WAVE_RAM + ((ch->phase >> 17) & 15));
+          level = (ch->phase >> 16) & 1 ? level & 15 : level >> 4;
+          level >>= apu_wave_shifts[(apu_reg(NR32) >> 5) & 3];
+          ch->phase += ch->phase_step;
+          break;
+        case APU_NOISE:
+          level = (~ch->lfsr & 1) * ch->volume;
+          clocks = (ch->phase + ch->phase_step) >> 16;
+          ch->phase = (ch->phase + ch->phase_step) & 0xffff;
+          for (; clocks; clocks--) {
+            u32 x = (ch->lfsr ^ ch->lfsr >> 1) & 1;
+            ch->lfsr = ch->lfsr >> 1 | x << 14;
+            if (apu_reg(NR43) & 0x08) ch->lfsr = (ch->lfsr & ~0x40) | x << 6;
+          }
+          break;
+      }
+      mix += (s32)level * 2;
+    }
+    mix *= master;
+    apu.prv_out += (mix - apu.prv_in) * 256 - (apu.prv_out >> 8);
+    apu.prv_in = mix;
+    sample = apu.prv_out >> 8;
+    out[i] = sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample;
+  }
+}
+
+/* the game side queues register writes in a single producer single consumer ring and whoever
+ * plays the audio applies them and synthesizes exactly the samples it is about to hand over,
+ * so nothing is rendered ahead of the consumer. positions run free and only the producer moves
+ * audio_write_pos and only the consumer audio_read_pos, they are only touched with atomics which
+ * are also full barriers. neither side blocks, a sound that doesn't fit is dropped */
+#define sync_load(X) __sync_fetch_and_add(&(X), 0) /* an atomic read */
+#define AUDIO_CMDS 256 /* a power of two */
+apu_cmd audio_cmds[AUDIO_CMDS];
+u32 audio_write_pos, audio_read_pos;
+u32 audio_dropped; /* producer side */
+
+/* a sound goes in whole or not at all */
+void
+audio_queue(const apu_cmd *cmds, u32 amount) {
+  u32 w = sync_load(audio_write_pos), i;
+  if (w - sync_load(audio_read_pos) + amount > AUDIO_CMDS) {
+    audio_dropped++;
+    return;
+  }
+  for (i = 0; i < amount; i++) audio_cmds[(w + i) % AUDIO_CMDS] = cmds[i];
+  __sync_fetch_and_add(&audio_write_pos, amount);
+}
+
+/* applies what was queued up to now and fills out */
+void
+audio_render(s16 *out, u32 amount) {
+  u32 r = sync_load(audio_read_pos), w = sync_load(audio_write_pos), i;
+  for (i = r; i != w; i++) apu_write(audio_cmds[i % AUDIO_CMDS].reg, audio_cmds[i % AUDIO_CMDS].value);
+  __sync_fetch_and_add(&audio_read_pos, w - r);
+  apu_render(out, amount);
+}
+
+/* for when nothing plays, keeps the ring from filling up */
+void
+audio_discard(void) {
+  __sync_fetch_and_add(&audio_read_pos, sync_load(audio_write_pos) - sync_load(audio_read_pos));
+}
+
+/* gameplay stuff */
+#define ENTITIES_CAP (LVL_CHUNKS_CAP * LVL_CHUNK * LVL_CHUNK) /* one per resident tile */
+#define ENTITY_NONE  0xffff
+#define ENTITY_SOLID (1 << 0) /* blocks the player */
+#define ENTITY_BG    (1 << 1) /* static, drawn in the background map instead of with a sprite */
+enum {
+  ENTITY_KEY = 0,
+  ENTITY_DOOR,
+  ENTITY_ARROW
+};
+
+/* everything the simulation changes, kept in one block so it can be snapshotted */
+typedef struct {
+  fx  player_x,  player_y;
+  s32 player_nx, player_ny;
+  b8 player_walking;
+  direction player_dir;
+
+  b8 grow_level;
+  direction grow_level_dir;
+  fx  level_x_min, level_x_max, level_y_min, level_y_max;
+  s32 level_nx_min, level_nx_max, level_ny_min, level_ny_max;
+
+  /* every object of a level lives in this pool, in structure-of-arrays form. the live ones
+   * are packed in [0, entities_amount) so passes walk tight arrays, removing one moves the
+   * last into its slot. handles stay valid meanwhile, they are mapped through entity_slot */
+  s32 entity_x[ENTITIES_CAP], entity_y[ENTITIES_CAP];
+  u8  entity_type[ENTITIES_CAP];
+  u8  entity_tile[ENTITIES_CAP];
+  u8  entity_flags[ENTITIES_CAP];
+  u8  entity_arg[ENTITIES_CAP]; /* arrow: direction */
+  u16 entity_src[ENTITIES_CAP]; /* arrow: index in the level entities */
+  u16 entity_handle[ENTITIES_CAP]; /* slot -> handle */
+  u16 entity_slot[ENTITIES_CAP];   /* handle -> slot */
+  u16 entity_free[ENTITIES_CAP];
+  u32 entity_free_amount;
+  u32 entities_amount;
+
+  /* the resident chunks with the handle of the entity on each of their tiles, a finished step is
+   * resolved with one lookup. a chunk's entities are spawned when it is loaded and removed when it
+   * is evicted, what was taken meanwhile is kept in key_taken and level_entity_taken */
+  u16 chunk_idx[LVL_CHUNKS_CAP]; /* y * LVL_CHUNKS_W + x, or CHUNK_NONE */
+  u16 chunk_grid[LVL_CHUNKS_CAP][LVL_CHUNK * LVL_CHUNK];
+  b8 key_taken;
+  u8 level_entity_taken[LEVEL_ENTITIES_CAP / 8];
+  s32 world_w, world_h; /* in pixels, the camera stays inside. they grow when the level finishes growing past them */
+
+  transition end_level;
+  transition begin_level;
+  u32 transition_timer; /* in simulation steps */
+  u32 current_level;
+  rgb palette[COLORS_AMOUNT];
+} game_state;
+game_state game;
+
+/* what draw() sees, interpolated between the last two simulation steps */
+fx  prv_player_x, prv_player_y;
+fx  prv_level_x_min, prv_level_x_max, prv_level_y_min, prv_level_y_max;
+s32 render_player_x, render_player_y;
+s32 render_level_x_min, render_level_x_max, render_level_y_min, render_level_y_max;
+
+#define CHUNK_NONE 0xffff
+
+#define OAM_PLAYER   0
+#define OAM_ENTITIES 1
+#define KEY_TILE       (1 * ATLAS_TW)
+#define DOOR_TILE      (2 * ATLAS_TW)
+#define DOOR_OPEN_TILE (2 * ATLAS_TW + 1)
+#define ARROWS_TILE    (3 * ATLAS_TW) /* plus the direction */
+
+#define PLAYER_SPEED 80
+#define PLAYER_STEP  (FX(PLAYER_SPEED) / SIM_HZ) /* per simulation step */
+
+#define TRANSITION_STEPS (SIM_HZ / 5)
+
+/* sound effects, as apu register writes */
+#define play_sfx(S) audio_queue((S), sizeof (S) / sizeof (apu_cmd))
+apu_cmd sfx_key[]    = { { NR10, 0x27 }, { NR11, 0x80 }, { NR12, 0xf3 }, { NR13, 0x0a }, { NR14, 0x87 } };
+apu_cmd sfx_arrow[]  = { { NR21, 0x40 }, { NR22, 0xa2 }, { NR23, 0x83 }, { NR24, 0x87 } };
+apu_cmd sfx_door[]   = { { NR30, 0x80 }, { NR31, 0xc0 }, { NR32, 0x20 }, { NR33, 0x06 }, { NR34, 0xc7 } };
+apu_cmd sfx_reload[] = { { NR41, 0x20 }, { NR42, 0xa2 }, { NR43, 0x52 }, { NR44, 0xc0 } };
+
+/* begin text of the current level */
+u32 begin_txt_lines_amount;
+s32 begin_txt_x[BEGIN_TXT_LINES_CAP];
+s32 begin_txt_y[BEGIN_TXT_LINES_CAP];
+s32 begin_txt_run[BEGIN_TXT_LINES_CAP];
+
+/* returns 0 outside of the level or of the resident chunks, a grown level can reach past the level */
+u16 *
+level_cell(s32 x, s32 y) {
+  u32 i, tx, ty, chunk;
+  if (x < 0 || y < 0 || x >= LVL_MAX_W * TILE_SIZE || y >= LVL_MAX_H * TILE_SIZE) return 0;
+  tx = x / TILE_SIZE;
+  ty = y / TILE_SIZE;
+  chunk = (ty / LVL_CHUNK) * LVL_CHUNKS_W + tx / LVL_CHUNK;
+  for (i = 0; i < LVL_CHUNKS_CAP; i++) {
+    if (game.chunk_idx[i] == chunk) return &game.chunk_grid[i][(ty % LVL_CHUNK) * LVL_CHUNK + tx % LVL_CHUNK];
+  }
+  return 0;
+}
+
+void
+clear_entities(void) {
+  u32 i;
+  game.entities_amount = 0;
+  game.entity_free_amount = ENTITIES_CAP;
+  for (i = 0; i < ENTITIES_CAP; i++) game.entity_free[i] = ENTITIES_CAP - 1 - i;
+  for (i = 0; i < LVL_CHUNKS_CAP; i++) game.chunk_idx[i] = CHUNK_NONE;
+}
+
+/* returns the handle, or ENTITY_NONE when the tile is taken or outside of the grid */
+u16
+spawn_entity(u8 type, u8 arg, s32 x, s32 y, u8 tile, u8 flags) {
+  u16 *c = level_cell(x, y);
+  u32 slot;
+  if (!c || *c != ENTITY_NONE || !game.entity_free_amount) return ENTITY_NONE;
+  slot = game.entities_amount++;
+  *c = game.entity_free[--game.entity_free_amount];
+  game.entity_handle[slot] = *c;
+  game.entity_slot[*c]     = slot;
+  game.entity_x[slot]      = x;
+  game.entity_y[slot]      = y;
+  game.entity_type[slot]   = type;
+  game.entity_tile[slot]   = tile;
+  game.entity_flags[slot]  = flags;
+  game.entity_arg[slot]    = arg;
+  game.entity_src[slot]    = ENTITY_NONE;
+  return *c;
+}
+
+void
+remove_entity(u16 handle) {
+  u32 slot = game.entity_slot[handle], last = --game.entities_amount;
+  s32 x = game.entity_x[slot], y = game.entity_y[slot];
+  *level_cell(x, y) = ENTITY_NONE;
+  game.entity_x[slot]      = game.entity_x[last];
+  game.entity_y[slot]      = game.entity_y[last];
+  game.entity_type[slot]   = game.entity_type[last];
+  game.entity_tile[slot]   = game.entity_tile[last];
+  game.entity_flags[slot]  = game.entity_flags[last];
+  game.entity_arg[slot]    = game.entity_arg[last];
+  game.entity_src[slot]    = game.entity_src[last];
+  game.entity_handle[slot] = game.entity_handle[last];
+  game.entity_slot[game.entity_handle[slot]] = slot;
+  game.entity_free[game.entity_free_amount++] = handle;
+}
+
+/* the view is centered on the player and kept inside [0, world) */
+s32
+camera_axis(s32 player, s32 world, s32 view) {
+  s32 c = player + TILE_SIZE / 2 - view / 2;
+  if (c > world - view) c = world - view;
+  if (c < 0) c = 0;
+  return c;
+}
+
+/* spawns what of the chunk wasn't taken yet, chunks past the level are left empty */
+void
+load_chunk(u32 slot, u32 chunk) {
+  const level *lvl = get_level(game.current_level);
+  u32 i, cx = chunk % LVL_CHUNKS_W, cy = chunk / LVL_CHUNKS_W;
+  game.chunk_idx[slot] = chunk;
+  memset(game.chunk_grid[slot], 0xff, sizeof (game.chunk_grid[slot]));
+  if (!game.key_taken && lvl->key_x / LVL_CHUNK == cx && lvl->key_y / LVL_CHUNK == cy) {
+    spawn_entity(ENTITY_KEY, 0, lvl->key_x * TILE_SIZE, lvl->key_y * TILE_SIZE, KEY_TILE, 0);
+  }
+  if (lvl->door_x / LVL_CHUNK == cx && lvl->door_y / LVL_CHUNK == cy) {
+    spawn_entity(ENTITY_DOOR, 0, lvl->door_x * TILE_SIZE, lvl->door_y * TILE_SIZE,
+        game.key_taken ? DOOR_OPEN_TILE : DOOR_TILE, game.key_taken ? 0 : ENTITY_SOLID);
+  }
+  if (cx >= level_chunks_w(lvl) || cy >= level_chunks_h(lvl)) return;
+  chunk = cy * level_chunks_w(lvl) + cx;
+  for (i = level_chunk_table(lvl)[chunk]; i < level_chunk_table(lvl)[chunk + 1]; i++) {
+    const level_entity *e = &level_entities(lvl)[i];
+    u16 handle;
+    if (game.level_entity_taken[i >> 3] & (1 << (i & 7))) continue;
+    switch (e->type) {
+      case LEVEL_ENTITY_ARROW:
+        handle = spawn_entity(ENTITY_ARROW, e->arg, e->x * TILE_SIZE, e->y * TILE_SIZE, ARROWS_TILE + e->arg, ENTITY_BG);
+        if (handle != ENTITY_NONE) game.entity_src[game.entity_slot[handle]] = i;
+        break;
+    }
+  }
+}
+
+void
+unload_chunk(u32 slot) {
+  u32 i;
+  for (i = 0; i < LVL_CHUNK * LVL_CHUNK; i++) {
+    if (game.chunk_grid[slot][i] != ENTITY_NONE) remove_entity(game.chunk_grid[slot][i]);
+  }
+  game.chunk_idx[slot] = CHUNK_NONE;
+}
+
+/* keeps the chunks within LVL_CHUNK_MARGIN tiles of the view resident and evicts the rest,
+ * so the cost of a level is bounded by the view instead of by its area */
+void
+stream_chunks(void) {
+  s32 view_x = camera_axis(FX_INT(game.player_x), game.world_w, GAME_W) / TILE_SIZE;
+  s32 view_y = camera_axis(FX_INT(game.player_y), game.world_h, GAME_H) / TILE_SIZE;
+  s32 cx_min = view_x - LVL_CHUNK_MARGIN, cy_min = view_y - LVL_CHUNK_MARGIN;
+  s32 cx_max = view_x + GAME_TW + LVL_CHUNK_MARGIN, cy_max = view_y + GAME_TH + LVL_CHUNK_MARGIN;
+  u32 i, cx, cy;
+  if (cx_min < 0) cx_min = 0;
+  if (cy_min < 0) cy_min = 0;
+  if (cx_max > LVL_MAX_W - 1) cx_max = LVL_MAX_W - 1;
+  if (cy_max > LVL_MAX_H - 1) cy_max = LVL_MAX_H - 1;
+  cx_min /= LVL_CHUNK;
+  cy_min /= LVL_CHUNK;
+  cx_max /= LVL_CHUNK;
+  cy_max /= LVL_CHUNK;
+  for (i = 0; i < LVL_CHUNKS_CAP; i++) {
+    u32 chunk = game.chunk_idx[i];
+    if (chunk == CHUNK_NONE) continue;
+    cx = chunk % LVL_CHUNKS_W;
+    cy = chunk / LVL_CHUNKS_W;
+    if ((s32)cx < cx_min || (s32)cx > cx_max || (s32)cy < cy_min || (s32)cy > cy_max) unload_chunk(i);
+  }
+  for (cy = cy_min; (s32)cy <= cy_max; cy++) {
+    for (cx = cx_min; (s32)cx <= cx_max; cx++) {
+      u32 chunk = cy * LVL_CHUNKS_W + cx, free_slot = LVL_CHUNKS_CAP;
+      for (i = 0; i < LVL_CHUNKS_CAP; i++) {
+        if (game.chunk_idx[i] == chunk) break;
+        if (game.chunk_idx[i] == CHUNK_NONE && free_slot == LVL_CHUNKS_CAP) free_slot = i;
+      }
+      if (i == LVL_CHUNKS_CAP && free_slot < LVL_CHUNKS_CAP) load_chunk(free_slot, chunk);
+    }
+  }
+}
+
+void
+save_render_state(void) {
+  prv_player_x    = game.player_x;
+  prv_player_y    = game.player_y;
+  prv_level_x_min = game.level_x_min;
+  prv_level_x_max = game.level_x_max;
+  prv_level_y_min = game.level_y_min;
+  prv_level_y_max = game.level_y_max;
+}
+
+/* alpha goes from 0 to FX_ONE */
+void
+interpolate_render_state(fx alpha) {
+#if RENDER_INTERPOLATION
+  render_player_x    = FX_INT(prv_player_x    + FX_INT((game.player_x    - prv_player_x)    * alpha));
+  render_player_y    = FX_INT(prv_player_y    + FX_INT((game.player_y    - prv_player_y)    * alpha));
+  render_level_x_min = FX_INT(prv_level_x_min + FX_INT((game.level_x_min - prv_level_x_min) * alpha));
+  render_level_x_max = FX_INT(prv_level_x_max + FX_INT((game.level_x_max - prv_level_x_max) * alpha));
+  render_level_y_min = FX_INT(prv_level_y_min + FX_INT((game.level_y_min - prv_level_y_min) * alpha));
+  render_level_y_max = FX_INT(prv_level_y_max + FX_INT((game.level_y_max - prv_level_y_max) * alpha));
+#else
+  (void)alpha;
+  render_player_x    = FX_INT(game.player_x);
+  render_player_y    = FX_INT(game.player_y);
+  render_level_x_min = FX_INT(game.level_x_min);
+  render_level_x_max = FX_INT(game.level_x_max);
+  render_level_y_min = FX_INT(game.level_y_min);
+  render_level_y_max = FX_INT(game.level_y_max);
+#endif
+}
+
+void
+load_level(u32 level_idx) {
+  const level *lvl = get_level(level_idx);
+  game.player_walking = 0;
+  game.player_dir = 0;
+  game.level_nx_min = lvl->x * TILE_SIZE;
+  game.level_ny_min = lvl->y * TILE_SIZE;
+  game.level_nx_max = (lvl->x + lvl->w) * TILE_SIZE;
+  game.level_ny_max = (lvl->y + lvl->h) * TILE_SIZE;
+  game.level_x_min = FX(game.level_nx_min);
+  game.level_y_min = FX(game.level_ny_min);
+  game.level_x_max = FX(game.level_nx_max);
+  game.level_y_max = FX(game.level_ny_max);
+  game.player_nx = lvl->player_x * TILE_SIZE;
+  game.player_ny = lvl->player_y * TILE_SIZE;
+  game.player_x  = FX(game.player_nx);
+  game.player_y  = FX(game.player_ny);
+  game.world_w = game.level_nx_max;
+  game.world_h = game.level_ny_max;
+  ppu_write(ppu.lcdc, PPU_LCDC_BG | PPU_LCDC_SPRITES);
+  clear_entities();
+  game.key_taken = 0;
+  memset(game.level_entity_taken, 0, sizeof (game.level_entity_taken));
+  game.current_level = level_idx;
+  stream_chunks();
+  save_render_state();
+  reset_drawing_bounds();
+}
+
+void
+prepare_begin_txt(u32 level_idx) {
+  u32 i;
+  s32 y;
+  const level *lvl = get_level(level_idx);
+  clear_text_runs();
+  begin_txt_lines_amount = lvl->begin_txt_lines;
+  y = (GAME_H >> 1) - ((begin_txt_lines_amount * TILE_SIZE) >> 1);
+  for (i = 0; i < begin_txt_lines_amount; i++) {
+    begin_txt_x[i] = (GAME_W >> 1) - ((strlen(level_begin_txt(lvl, i)) * TILE_SIZE) >> 1);
+    begin_txt_y[i] = y;
+    begin_txt_run[i] = cache_text_run(level_begin_txt(lvl, i));
+    y += TILE_SIZE;
+  }
+}
+
+/* rewind history: a ring of one delta per simulation step, each one the xor of a snapshot of
+ * game against the previous one. deltas are {u16 zero words, u16 literal words} headers packed
+ * in a u32 and followed by the literal words, trailing zeros are dropped. rewind_prv is the
+ * newest snapshot, undoing a step is xoring the newest delta back into it */
+#define REWIND_STEPS (SIM_HZ * REWIND_SECONDS)
+#define GAME_WORDS   (sizeof (game_state) / sizeof (u32))
+#define REWIND_BLOCK 16 /* words */
+game_state rewind_prv;
+u8 rewind_arena[REWIND_ARENA_SZ];
+u32 rewind_offset[REWIND_STEPS];
+u32 rewind_size[REWIND_STEPS];
+u32 rewind_first, rewind_amount; /* oldest delta and how many there are */
+u32 rewind_end; /* where the next delta goes */
+u32 rewind_scratch[GAME_WORDS * 2];
+
+void
+rewind_reset(void) {
+  rewind_prv = game;
+  rewind_first = rewind_amount = rewind_end = 0;
+}
+
+/* the words are copied out with memcpy so the u8 and u16 fields aren't read through a u32 pointer */
+#define load_word(W, P, I) memcpy(&(W), (P) + (I) * sizeof (u32), sizeof (u32))
+#define store_word(P, I, W) memcpy((P) + (I) * sizeof (u32), &(W), sizeof (u32))
+
+void
+rewind_push(void) {
+  const u8 *cur = (const u8 *)&game;
+  u8 *prv = (u8 *)&rewind_prv;
+  u32 i = 0, n = 0, size, pos, idx;
+  b8 wrapped;
+  /* encode and bring rewind_prv up to date in the same pass */
+  while (i < GAME_WORDS) {
+    u32 zeros = 0, literals = 0, head, a = 0, b = 0;
+    for (; i < GAME_WORDS; i++, zeros++) {
+      /* most of game is the resident chunks and the entity pool, untouched blocks are skipped whole */
+      if (!(i % REWIND_BLOCK) && i + REWIND_BLOCK <= GAME_WORDS &&
+          !memcmp(cur + i * sizeof (u32), prv + i * sizeof (u32), REWIND_BLOCK * sizeof (u32))) {
+        i += REWIND_BLOCK - 1;
+        zeros += REWIND_BLOCK - 1;
+        continue;
+      }
+      load_word(a, cur, i);
+      load_word(b, prv, i);
+      if (a != b) break;
+    }
+    if (i == GAME_WORDS) break;
+    head = n++;
+    for (; i < GAME_WORDS; i++, literals++) {
+      load_word(a, cur, i);
+      load_word(b, prv, i);
+      if (a == b) break;
+      rewind_scratch[n++] = a ^ b;
+      store_word(prv, i, a);
+    }
+    rewind_scratch[head] = zeros | literals << 16;
+  }
+  size = n * sizeof (u32);
+  if (size > REWIND_ARENA_SZ) {
+    rewind_amount = 0;
+    rewind_end = 0;
+    return;
+  }
+  pos = rewind_end;
+  wrapped = pos + size > REWIND_ARENA_SZ;
+  if (wrapped) pos = 0;
+  /* drop the oldest deltas until there is room, along with the ones past a wrap */
+  while (rewind_amount) {
+    u32 o = rewind_offset[rewind_first];
+    if (rewind_amount < REWIND_STEPS && !(o < pos + size && pos < o + rewind_size[rewind_first]) &&
+        !(wrapped && o >= rewind_end)) break;
+    rewind_first = (rewind_first + 1) % REWIND_STEPS;
+    rewind_amount--;
+  }
+  idx = (rewind_first + rewind_amount++) % REWIND_STEPS;
+  rewind_offset[idx] = pos;
+  rewind_size[idx]   = size;
+  memcpy(rewind_arena + pos, rewind_scratch, size);
+  rewind_end = pos + size;
+}
+
+/* steps game back once, returns 0 when the history ran out */
+b8
+rewind_pop(void) {
+  u8 *prv = (u8 *)&rewind_prv;
+  u32 idx, i, t, n, w, x, prv_level = game.current_level;
+  if (!rewind_amount) return 0;
+  idx = (rewind_first + --rewind_amount) % REWIND_STEPS;
+  n = rewind_size[idx] / sizeof (u32);
+  memcpy(rewind_scratch, rewind_arena + rewind_offset[idx], rewind_size[idx]);
+  for (i = 0, t = 0; t < n;) {
+    u32 literals = rewind_scratch[t] >> 16;
+    i += rewind_scratch[t++] & 0xffff;
+    for (; literals; literals--, i++, t++) {
+      load_word(w, prv, i);
+      x = w ^ rewind_scratch[t];
+      store_word(prv, i, x);
+    }
+  }
+  rewind_end = rewind_offset[idx];
+  game = rewind_prv;
+  if (game.current_level != prv_level) prepare_begin_txt(game.current_level);
+  return 1;
+}
+
+void
+init(void) {
+  u32 i;
+  init_tiles();
+  init_glyphs();
+  init_raster_threads();
+  ppu_reset();
+  apu_reset();
+  game.end_level.is_happening = 1;
+  game.end_level.fade_state = FADE_IN;
+  game.begin_level.is_happening = 0;
+  game.begin_level.fade_state = 0;
+  game.transition_timer = 0;
+  game.current_level = 0;
+  game.grow_level = 0;
+  clear_entities();
+  for (i = 0; i < COLORS_AMOUNT; i++) game.palette[i] = colors[BLACK];
+  prepare_begin_txt(0);
+  reset_drawing_bounds();
+  rewind_reset();
+}
+
+void
+player_setup_movement(direction next_dir, s32 add_to_nx, s32 add_to_ny,
+    b8 shrink_level_x_min, b8 shrink_level_y_min, b8 shrink_level_x_max, b8 shrink_level_y_max) {
+  u16 *c;
+  s32 level_x_min = FX_INT(game.level_x_min), level_y_min = FX_INT(game.level_y_min);
+  s32 level_x_max = FX_INT(game.level_x_max), level_y_max = FX_INT(game.level_y_max);
+  game.player_nx = FX_INT(game.player_x) + add_to_nx;
+  game.player_ny = FX_INT(game.player_y) + add_to_ny;
+  c = level_cell(game.player_nx, game.player_ny);
+  if (rect_collide(game.player_nx, game.player_ny, game.player_nx + TILE_SIZE, game.player_ny + TILE_SIZE, level_x_min, level_y_min, level_x_max, level_y_max) &&
+    (!c || *c == ENTITY_NONE || !(game.entity_flags[game.entity_slot[*c]] & ENTITY_SOLID))) {
+    game.player_dir = next_dir;
+    game.player_walking = 1;
+    game.level_nx_min = level_x_min + TILE_SIZE * shrink_level_x_min;
+    game.level_ny_min = level_y_min + TILE_SIZE * shrink_level_y_min;
+    game.level_nx_max = level_x_max - TILE_SIZE * shrink_level_x_max;
+    game.level_ny_max = level_y_max - TILE_SIZE * shrink_level_y_max;
+  }
+}
+
+/* the player finished a step on the entity */
+void
+touch_entity(u16 handle) {
+  u32 i, slot = game.entity_slot[handle];
+  switch (game.entity_type[slot]) {
+    case ENTITY_KEY:
+      for (i = 0; i < game.entities_amount; i++) {
+        if (game.entity_type[i] != ENTITY_DOOR) continue;
+        game.entity_tile[i]   = DOOR_OPEN_TILE;
+        game.entity_flags[i] &= ~ENTITY_SOLID;
+      }
+      game.key_taken = 1;
+      play_sfx(sfx_key);
+      remove_entity(handle);
+      break;
+    case ENTITY_DOOR:
+      play_sfx(sfx_door);
+      game.end_level.is_happening = 1;
+      game.transition_timer = 0;
+      break;
+    case ENTITY_ARROW:
+      play_sfx(sfx_arrow);
+      game.grow_level_dir = game.entity_arg[slot];
+      switch (game.grow_level_dir) {
+        case D_UP:
+          game.level_ny_min = FX_INT(game.level_y_min) - TILE_SIZE;
+          game.grow_level = 1;
+          break;
+        case D_LEFT:
+          game.level_nx_min = FX_INT(game.level_x_min) - TILE_SIZE;
+          game.grow_level = 1;
+          break;
+        case D_RIGHT:
+          game.level_nx_max = FX_INT(game.level_x_max) + TILE_SIZE;
+          game.grow_level = 1;
+          break;
+        case D_DOWN:
+          game.level_ny_max = FX_INT(game.level_y_max) + TILE_SIZE;
+          game.grow_level = 1;
+          break;
+      }
+      i = game.entity_src[slot];
+      if (i != ENTITY_NONE) game.level_entity_taken[i >> 3] |= 1 << (i & 7);
+      remove_entity(handle);
+      break;
+  }
+}
+
+void
+player_move(b8 reached, s32 sign_x, s32 sign_y,
+    b8 shrink_level_x_min, b8 shrink_level_y_min, b8 shrink_level_x_max, b8 shrink_level_y_max) {
+  if (reached) {
+    u16 *c;
+    game.player_y = FX(game.player_ny);
+    game.player_x = FX(game.player_nx);
+    game.player_walking = 0;
+    game.level_x_min = FX(game.level_nx_min);
+    game.level_y_min = FX(game.level_ny_min);
+    game.level_x_max = FX(game.level_nx_max);
+    game.level_y_max = FX(game.level_ny_max);
+    c = level_cell(game.player_nx, game.player_ny);
+    if (c && *c != ENTITY_NONE) touch_entity(*c);
+  } else {
+    game.player_x += PLAYER_STEP * sign_x;
+    game.player_y += PLAYER_STEP * sign_y;
+    game.level_x_min += PLAYER_STEP * shrink_level_x_min;
+    game.level_y_min += PLAYER_STEP * shrink_level_y_min;
+    game.level_x_max -= PLAYER_STEP * shrink_level_x_max;
+    game.level_y_max -= PLAYER_STEP * shrink_level_y_max;
+  }
+}
+
+b8
+fade_out(void) {
+  if (game.palette[WHITE] == colors[WHITE]) {
+    game.palette[WHITE]      = colors[LIGHT_GRAY];
+    game.palette[LIGHT_GRAY] = colors[DARK_GRAY];
+    game.palette[DARK_GRAY]  = colors[BLACK];
+  } else if (game.palette[WHITE] == colors[LIGHT_GRAY]) {
+    game.palette[WHITE]      = colors[DARK_GRAY];
+    game.palette[LIGHT_GRAY] = colors[BLACK];
+  } else if (game.palette[WHITE] == colors[DARK_GRAY]) {
+    game.palette[WHITE]      = colors[BLACK];
+  } else if (game.palette[WHITE] == colors[BLACK]) {
+    return 1;
+  }
+  return 0;
+}
+
+b8
+fade_in(void) {
+  if (game.palette[WHITE] == colors[BLACK]) {
+    game.palette[WHITE]      = colors[DARK_GRAY];
+  } else if (game.palette[WHITE] == colors[DARK_GRAY]) {
+    game.palette[WHITE]      = colors[LIGHT_GRAY];
+    game.palette[LIGHT_GRAY] = colors[DARK_GRAY];
+  } else if (game.palette[WHITE] == colors[LIGHT_GRAY]) {
+    game.palette[WHITE]      = colors[WHITE];
+    game.palette[LIGHT_GRAY] = colors[LIGHT_GRAY];
+    game.palette[DARK_GRAY]  = colors[DARK_GRAY];
+  } else if (game.palette[WHITE] == colors[WHITE]) {
+    return 1;
+  }
+  return 0;
+}
+
+void
+update(void) {
+  /* level transitions */
+  if (game.begin_level.is_happening) {
+    if (game.begin_level.fade_state == FADE_NONE) {
+      if (key_click(K_START)) game.begin_level.fade_state = FADE_OUT;
+    } else {
+      if (game.transition_timer < TRANSITION_STEPS) {
+        game.transition_timer++;
+      } else {
+        game.transition_timer = 0;
+        switch (game.begin_level.fade_state) {
+          case FADE_OUT:
+            if (fade_out()) {
+              game.begin_level.fade_state = FADE_IN;
+              load_level(game.current_level);
+            }
+            break;
+          case FADE_IN:
+            if (fade_in()) {
+              game.begin_level.fade_state = FADE_NONE;
+              game.begin_level.is_happening = 0;
+            }
+            break;
+          default: break;
+        }
+      }
+    }
+    return;
+  } else if (game.end_level.is_happening) {
+    if (game.transition_timer < TRANSITION_STEPS) {
+      game.transition_timer++;
+    } else {
+      game.transition_timer = 0;
+      switch (game.end_level.fade_state) {
+        case FADE_OUT:
+          if (fade_out()) {
+            game.end_level.fade_state = FADE_IN;
+            game.current_level = (game.current_level + 1) % levels_amount;
+            prepare_begin_txt(game.current_level);
           }
           break;
         case FADE_IN:
           if (fade_in()) {
-            end_level.is_happening = 0;
-            end_level.fade_state = FADE_OUT;
-            begin_level.is_happening = 1;
+            game.end_level.is_happening = 0;
+            game.end_level.fade_state = FADE_OUT;
+            game.begin_level.is_happening = 1;
           }
           break;
         default: break;
@@ -858,39 +2372,43 @@ update(f32 dt) {
     return;
   }
   
+  stream_chunks();
+
   /* update level */
-  if (grow_level) {
-    switch (grow_level_dir) {
+  if (game.grow_level) {
+    switch (game.grow_level_dir) {
       case D_UP:
-        if (level_y_min < level_ny_min) {
-          level_y_min = level_ny_min;
-          grow_level = 0;
+        if (game.level_y_min <= FX(game.level_ny_min)) {
+          game.level_y_min = FX(game.level_ny_min);
+          game.grow_level = 0;
         } else {
-          level_y_min -= PLAYER_SPEED * dt;
+          game.level_y_min -= PLAYER_STEP;
         }
         break;
       case D_LEFT:
-        if (level_x_min < level_nx_min) {
-          level_x_min = level_nx_min;
-          grow_level = 0;
+        if (game.level_x_min <= FX(game.level_nx_min)) {
+          game.level_x_min = FX(game.level_nx_min);
+          game.grow_level = 0;
         } else {
-          level_x_min -= PLAYER_SPEED * dt;
+          game.level_x_min -= PLAYER_STEP;
         }
         break;
       case D_RIGHT:
-        if (level_x_max > level_nx_max) {
-          level_x_max = level_nx_max;
-          grow_level = 0;
+        if (game.level_x_max >= FX(game.level_nx_max)) {
+          game.level_x_max = FX(game.level_nx_max);
+          if (game.world_w < game.level_nx_max) game.world_w = game.level_nx_max;
+          game.grow_level = 0;
         } else {
-          level_x_max += PLAYER_SPEED * dt;
+          game.level_x_max += PLAYER_STEP;
         }
         break;
       case D_DOWN:
-        if (level_y_max > level_ny_max) {
-          level_y_max = level_ny_max;
-          grow_level = 0;
+        if (game.level_y_max >= FX(game.level_ny_max)) {
+          game.level_y_max = FX(game.level_ny_max);
+          if (game.world_h < game.level_ny_max) game.world_h = game.level_ny_max;
+          game.grow_level = 0;
         } else {
-          level_y_max += PLAYER_SPEED * dt;
+          game.level_y_max += PLAYER_STEP;
         }
         break;
     }
@@ -898,55 +2416,709 @@ update(f32 dt) {
   }
 
   /* update player */
-  if (!player_walking) {
-    if (key_click(K_B))     load_level(current_level);
+  if (!game.player_walking) {
+    if (key_click(K_B)) {
+      play_sfx(sfx_reload);
+      load_level(game.current_level);
+    }
     if (key_click(K_UP))    player_setup_movement(D_UP,    0,        -TILE_SIZE, 0, 0, 0, 1);
     if (key_click(K_LEFT))  player_setup_movement(D_LEFT, -TILE_SIZE, 0        , 0, 0, 1, 0);
     if (key_click(K_DOWN))  player_setup_movement(D_DOWN,  0,         TILE_SIZE, 0, 1, 0, 0);
     if (key_click(K_RIGHT)) player_setup_movement(D_RIGHT, TILE_SIZE, 0        , 1, 0, 0, 0);
   } else {
-    switch (player_dir) {
-      case D_UP:    player_move(player_y < player_ny-1, dt,  0, -1, 0, 0, 0, 1); break;
-      case D_LEFT:  player_move(player_x < player_nx-1, dt, -1,  0, 0, 0, 1, 0); break;
-      case D_DOWN:  player_move(player_y > player_ny+1, dt,  0,  1, 0, 1, 0, 0); break;
-      case D_RIGHT: player_move(player_x > player_nx+1, dt,  1,  0, 1, 0, 0, 0); break;
+    switch (game.player_dir) {
+      case D_UP:    player_move(game.player_y <= FX(game.player_ny),  0, -1, 0, 0, 0, 1); break;
+      case D_LEFT:  player_move(game.player_x <= FX(game.player_nx), -1,  0, 0, 0, 1, 0); break;
+      case D_DOWN:  player_move(game.player_y >= FX(game.player_ny),  0,  1, 0, 1, 0, 0); break;
+      case D_RIGHT: player_move(game.player_x >= FX(game.player_nx),  1,  0, 1, 0, 0, 0); break;
     }
   }
 }
 
 void
 draw(void) {
-  u32 i;
-  if ((end_level.is_happening   && end_level.fade_state   != FADE_OUT) ||
-      (begin_level.is_happening && begin_level.fade_state != FADE_IN)) {
-    for (i = 0; i < levels_begin_txt_lines_amount[current_level]; i++) {
-      draw_text(levels_begin_txt_x[current_level][i], levels_begin_txt_y[current_level][i], levels[current_level].begin_txt[i]);
+  u32 i, sprite;
+  s32 tx, ty;
+  if ((game.end_level.is_happening   && game.end_level.fade_state   != FADE_OUT) ||
+      (game.begin_level.is_happening && game.begin_level.fade_state != FADE_IN)) {
+    for (i = 0; i < begin_txt_lines_amount; i++) {
+      if (begin_txt_run[i] < 0) {
+        draw_string(begin_txt_x[i], begin_txt_y[i], level_begin_txt(levels[game.current_level], i));
+      } else {
+        draw_text_run(begin_txt_x[i], begin_txt_y[i], begin_txt_run[i]);
+      }
     }
     return;
   }
-  draw_rect(level_x_min, level_y_min, level_x_max, level_y_max, DARK_GRAY);
-  set_drawing_bounds(level_x_min, level_y_min, level_x_max, level_y_max);
-  draw_tile(door_x, door_y, key_collected, 2);
-  if (!key_collected) draw_tile(key_x, key_y, 0, 1);
-  for (i = 0; i < arrows_amount; i++) {
-    if (!arrows[i].collected) draw_tile(arrows[i].x, arrows[i].y, arrows[i].dir, 3);
+  /* a growing level pushes the camera bounds along with it */
+  camera_x = camera_axis(render_player_x, render_level_x_max > game.world_w ? render_level_x_max : game.world_w, GAME_W);
+  camera_y = camera_axis(render_player_y, render_level_y_max > game.world_h ? render_level_y_max : game.world_h, GAME_H);
+  draw_rect(render_level_x_min, render_level_y_min, render_level_x_max, render_level_y_max, DARK_GRAY);
+  set_drawing_bounds(render_level_x_min, render_level_y_min, render_level_x_max, render_level_y_max);
+  /* the background map wraps every PPU_MAP_SIZE tiles, only the cells in view are refreshed */
+  ppu_write(ppu.scx, camera_x & 0xff);
+  ppu_write(ppu.scy, camera_y & 0xff);
+  for (ty = camera_y / TILE_SIZE; ty <= (camera_y + GAME_H - 1) / TILE_SIZE; ty++) {
+    for (tx = camera_x / TILE_SIZE; tx <= (camera_x + GAME_W - 1) / TILE_SIZE; tx++) {
+      u16 *c = level_cell(tx * TILE_SIZE, ty * TILE_SIZE);
+      u8 tile = BLANK_TILE;
+      if (c && *c != ENTITY_NONE && (game.entity_flags[game.entity_slot[*c]] & ENTITY_BG)) tile = game.entity_tile[game.entity_slot[*c]];
+      ppu_write_map(ppu.bg_map, (ty % PPU_MAP_SIZE) * PPU_MAP_SIZE + tx % PPU_MAP_SIZE, tile);
+    }
+  }
+  /* the player goes on top, then the entities in view that aren't in the background map */
+  ppu_set_sprite(OAM_PLAYER, render_player_x - camera_x, render_player_y - camera_y, 0, 0);
+  sprite = OAM_ENTITIES;
+  for (i = 0; i < game.entities_amount && sprite < PPU_OAM_CAP; i++) {
+    s32 x = game.entity_x[i] - camera_x, y = game.entity_y[i] - camera_y;
+    if (game.entity_flags[i] & ENTITY_BG) continue;
+    if (x + TILE_SIZE <= 0 || x >= GAME_W || y + TILE_SIZE <= 0 || y >= GAME_H) continue;
+    ppu_set_sprite(sprite++, x, y, game.entity_tile[i], 0);
   }
-  draw_tile(player_x, player_y, 0, 0);
+  for (; sprite < PPU_OAM_CAP; sprite++) ppu_set_sprite(sprite, ppu.oam[sprite].x, ppu.oam[sprite].y, ppu.oam[sprite].tile, PPU_SPRITE_HIDDEN);
+  draw_ppu();
   reset_drawing_bounds();
+  camera_x = camera_y = 0;
 }
 
+void
+simulate(void) {
+  save_render_state();
+  replay_step();
+  if (key_press(K_SELECT)) {
+    rewind_pop();
+  } else {
+    update();
+    rewind_push();
+  }
+  key_prv = key_cur;
+}
+
+/* frame capture, the game side only copies the screen and its palette into the next buffer and
+ * publishes it, the writer thread does the encoding and the file io. the buffers are a ring like
+ * the audio one, so the game side never makes a system call. the writer sleeps for a frame
+ * whenever it finds the ring empty */
+#ifdef CAPTURE
+typedef struct {
+  u8 screen[GAME_W * GAME_H];
+  rgb palette[COLORS_AMOUNT];
+  u32 steps; /* simulation steps it stays on, the video runs at SIM_HZ */
+} capture_buffer;
+capture_buffer capture_buffers[CAPTURE_BUFFERS];
+u32 capture_write_pos, capture_read_pos;
+b8 capture_quit;
+pthread_t capture_thread;
+FILE *capture_file;
+b8 capture_y4m;
+b8 capture_failed; /* writer */
+/* counters for the game side, printed at exit */
+u32 capture_frames, capture_dropped;
+f64 capture_time, capture_time_max;
+
+/* y4m frames are full resolution y, cb and cr planes in bt.601 limited range. raw frames are the
+ * palette as 4 u32 in host order followed by the color indices, the red channel in the low byte */
+u32
+capture_encode(const capture_buffer *buf, u8 *out) {
+  u8 y[COLORS_AMOUNT], cb[COLORS_AMOUNT], cr[COLORS_AMOUNT];
+  u32 i;
+  if (!capture_y4m) {
+    memcpy(out, buf->palette, sizeof (buf->palette));
+    memcpy(out + sizeof (buf->palette), buf->screen, sizeof (buf->screen));
+    return sizeof (buf->palette) + sizeof (buf->screen);
+  }
+  for (i = 0; i < COLORS_AMOUNT; i++) {
+    s32 r = buf->palette[i] & 0xff, g = buf->palette[i] >> 8 & 0xff, b = buf->palette[i] >> 16 & 0xff;
+    y[i]  = ((  66 * r + 129 * g +  25 * b + 128) >> 8) +  16;
+    cb[i] = (( -38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+    cr[i] = (( 112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+  }
+  memcpy(out, "FRAME\n", 6);
+  out += 6;
+  for (i = 0; i < GAME_W * GAME_H; i++) {
+    out[i]                       = y[buf->screen[i]];
+    out[i + GAME_W * GAME_H]     = cb[buf->screen[i]];
+    out[i + GAME_W * GAME_H * 2] = cr[buf->screen[i]];
+  }
+  return 6 + GAME_W * GAME_H * 3;
+}
+
+void
+capture_sleep(u32 ns) {
+  struct timespec t;
+  t.tv_sec  = 0;
+  t.tv_nsec = ns;
+  nanosleep(&t, 0);
+}
+
+/* writes what is queued until the game side quit and the ring is empty */
+void *
+capture_writer(void *arg) {
+  static u8 frame[6 + GAME_W * GAME_H * 3];
+  (void)arg;
+  for (;;) {
+    u32 r = sync_load(capture_read_pos), size, i;
+    if (r == sync_load(capture_write_pos)) {
+      if (sync_load(capture_quit)) break;
+      capture_sleep(1000000000 / SIM_HZ);
+      continue;
+    }
+    size = capture_encode(&capture_buffers[r % CAPTURE_BUFFERS], frame);
+    for (i = 0; i < capture_buffers[r % CAPTURE_BUFFERS].steps; i++) {
+      if (fwrite(frame, 1, size, capture_file) != size) capture_failed = 1;
+    }
+    __sync_fetch_and_add(&capture_read_pos, 1);
+  }
+  return 0;
+}
+
+/* handles "-capture <file>" */
+b8
+capture_option(const s8 *option, const s8 *path) {
+  u32 len;
+  if (!path || capture_file || strcmp(option, "-capture")) return 0;
+  if (!(capture_file = fopen(path, "wb"))) {
+    fprintf(stderr, "error: couldn't open '%s'\n", path);
+    return 0;
+  }
+  len = strlen(path);
+  capture_y4m = len >= 4 && !strcmp(path + len - 4, ".y4m");
+  if (capture_y4m) fprintf(capture_file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", GAME_W, GAME_H, SIM_HZ);
+  pthread_create(&capture_thread, 0, capture_writer, 0);
+  return 1;
+}
+
+/* called after a frame was drawn with the simulation steps it covers */
+void
+capture_push(u32 steps) {
+  capture_buffer *buf;
+  u32 w;
+  f64 start, time;
+  if (!capture_file || !steps) return;
+  w = sync_load(capture_write_pos);
+  if (w - sync_load(capture_read_pos) == CAPTURE_BUFFERS) {
+#ifdef HEADLESS
+    while (w - sync_load(capture_read_pos) == CAPTURE_BUFFERS) capture_sleep(100000);
+#else
+    capture_dropped++;
+    return;
+#endif
+  }
+  start = time_now();
+  buf = &capture_buffers[w % CAPTURE_BUFFERS];
+  memcpy(buf->screen, screen, sizeof (buf->screen));
+  memcpy(buf->palette, game.palette, sizeof (buf->palette));
+  buf->steps = steps;
+  __sync_fetch_and_add(&capture_write_pos, 1);
+  time = time_now() - start;
+  capture_time += time;
+  if (time > capture_time_max) capture_time_max = time;
+  capture_frames++;
+}
+
+void
+capture_close(void) {
+  if (!capture_file) return;
+  __sync_lock_test_and_set(&capture_quit, 1);
+  pthread_join(capture_thread, 0);
+  if (capture_failed) fprintf(stderr, "error: couldn't write the whole capture\n");
+  fclose(capture_file);
+  capture_file = 0;
+  fprintf(stderr, "capture %u frames, %u dropped, avg %.1fus, max %.1fus\n", capture_frames, capture_dropped,
+      capture_frames ? capture_time / capture_frames * 1000000 : 0, capture_time_max * 1000000);
+}
+#define CAPTURE_USAGE " [-capture <file>]"
+#else
+#define capture_option(OPTION, PATH) 0
+#define capture_push(STEPS)          ((void)0)
+#define capture_close()              ((void)0)
+#define CAPTURE_USAGE ""
+#endif
 
 /* entry point */
+#ifdef HEADLESS
+u32
+hash_screen(void) {
+  /* fnv-1a over the color indices and the palette they resolve to */
+  u32 i, hash = 2166136261u;
+  for (i = 0; i < GAME_W*GAME_H; i++) hash = (hash ^ screen[i]) * 16777619u;
+  for (i = 0; i < COLORS_AMOUNT; i++) hash = (hash ^ game.palette[i]) * 16777619u;
+  return hash;
+}
+
+/* the null and wav backends, a step worth of samples is rendered on the simulation thread after
+ * every step. the samples are written in host order, like the pack */
+FILE *audio_wav;
+u32 audio_wav_samples;
+
+void
+write_u32(FILE *file, u32 value) {
+  fwrite(&value, sizeof (value), 1, file);
+}
+
+void
+write_wav_header(void) {
+  u16 format[4] = { 1, 1, 2, 16 }; /* pcm, mono, bytes per frame, bits per sample */
+  fwrite("RIFF", 1, 4, audio_wav);
+  write_u32(audio_wav, 36 + audio_wav_samples * sizeof (s16));
+  fwrite("WAVEfmt ", 1, 8, audio_wav);
+  write_u32(audio_wav, 16);
+  fwrite(format, sizeof (u16), 2, audio_wav);
+  write_u32(audio_wav, AUDIO_RATE);
+  write_u32(audio_wav, AUDIO_RATE * sizeof (s16));
+  fwrite(format + 2, sizeof (u16), 2, audio_wav);
+  fwrite("data", 1, 4, audio_wav);
+  write_u32(audio_wav, audio_wav_samples * sizeof (s16));
+}
+
+b8
+audio_option(const s8 *option, const s8 *path) {
+  if (!path || audio_wav || strcmp(option, "-wav")) return 0;
+  if (!(audio_wav = fopen(path, "wb"))) {
+    fprintf(stderr, "error: couldn't open '%s'\n", path);
+    return 0;
+  }
+  write_wav_header();
+  return 1;
+}
+
+void
+audio_drain(void) {
+  s16 samples[AUDIO_STEP];
+  if (!audio_wav) {
+    audio_discard();
+    return;
+  }
+  audio_render(samples, AUDIO_STEP);
+  fwrite(samples, sizeof (s16), AUDIO_STEP, audio_wav);
+  audio_wav_samples += AUDIO_STEP;
+}
+
+void
+audio_close(void) {
+  if (!audio_wav) return;
+  fseek(audio_wav, 0, SEEK_SET);
+  write_wav_header();
+  fclose(audio_wav);
+}
+
+/* usage: gb11_headless [-pack <file>] [-record <file> | -replay <file>] [-wav <file>] [-capture <file>] <frames> [script]
+ * the script is a list of "<frames> <keys>" lines, frames being at least 1 and the keys the ones
+ * from key_callback (WADSJKUI) or '-' for none, it loops when it runs out.
+ * a replay overrides the script and ends the run when it runs out, -wav writes the audio
+ * and -capture the frames (-DCAPTURE) */
+s32
+main(s32 argc, s8 **argv) {
+  u32 frames, frame;
+  u32 script_frames = 0, script_lines = 0;
+  input script_keys = 0;
+  FILE *script = 0;
+  f64 start;
+  f64 seconds;
+  s32 arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg += 2) {
+    if (!pack_option(argv[arg], arg + 1 < argc ? argv[arg + 1] : 0) &&
+        !replay_option(argv[arg], arg + 1 < argc ? argv[arg + 1] : 0) &&
+        !audio_option(argv[arg], arg + 1 < argc ? argv[arg + 1] : 0) &&
+        !capture_option(argv[arg], arg + 1 < argc ? argv[arg + 1] : 0)) break;
+  }
+  if (arg >= argc || argv[arg][0] == '-' || !(frames = strtoul(argv[arg], 0, 10))) {
+    fprintf(stderr, "usage: %s [-pack <file>] [-record <file> | -replay <file>] [-wav <file>]" CAPTURE_USAGE " <frames> [script]\n", argv[0]);
+    return EXIT_USAGE;
+  }
+  if (arg + 1 < argc && !(script = fopen(argv[arg + 1], "r"))) {
+    fprintf(stderr, "error: couldn't open '%s'\n", argv[arg + 1]);
+    return EXIT_USAGE;
+  }
+  if (!load_pack(pack_path)) return EXIT_PACK;
+  init();
+  start = time_now();
+  for (frame = 0; frame < frames; frame++) {
+    /* scripted input */
+    while (script && !script_frames) {
+      s8 keys[16];
+      u32 i;
+      if (fscanf(script, "%u %15s", &script_frames, keys) != 2) {
+        if (feof(script) && script_lines) {
+          rewind(script);
+          script_lines = 0;
+          continue;
+        }
+        fprintf(stderr, "error: bad script line\n");
+        return EXIT_USAGE;
+      }
+      if (!script_frames) {
+        fprintf(stderr, "error: script line %u runs for 0 frames\n", script_lines + 1);
+        return EXIT_USAGE;
+      }
+      script_lines++;
+      script_keys = 0;
+      for (i = 0; keys[i]; i++) {
+        switch (keys[i]) {
+          case 'W': input_set(script_keys, K_UP);     break;
+          case 'A': input_set(script_keys, K_LEFT);   break;
+          case 'D': input_set(script_keys, K_RIGHT);  break;
+          case 'S': input_set(script_keys, K_DOWN);   break;
+          case 'J': input_set(script_keys, K_A);      break;
+          case 'K': input_set(script_keys, K_B);      break;
+          case 'U': input_set(script_keys, K_START);  break;
+          case 'I': input_set(script_keys, K_SELECT); break;
+        }
+      }
+    }
+    if (script_frames) script_frames--;
+    key_cur = script_keys;
+    /* logic */
+    profile_begin(PHASE_UPDATE);
+    simulate();
+    audio_drain();
+    interpolate_render_state(FX_ONE);
+    profile_end(PHASE_UPDATE);
+    if (replay_finished) break;
+    /* rendering */
+    profile_begin(PHASE_CLEAR);
+    clear_screen(BLACK);
+    profile_end(PHASE_CLEAR);
+    profile_begin(PHASE_DRAW);
+    draw();
+    profile_end(PHASE_DRAW);
+    profile_begin(PHASE_RASTER);
+    flush_draw_cmds();
+    profile_end(PHASE_RASTER);
+    capture_push(1);
+    printf("%u %08x\n", frame, hash_screen());
+    profile_next_frame();
+  }
+  seconds = time_now() - start;
+  fprintf(stderr, "%u frames in %.3fs, %.0f fps\n", frame, seconds, seconds > 0 ? frame / seconds : 0);
+  if (script) fclose(script);
+  replay_close();
+  audio_close();
+  capture_close();
+#ifdef PROFILE
+  profile_export_trace();
+#endif
+  return 0;
+}
+#else
+/* screen upload. UPLOAD_DIRECT hands the client memory to glTexSubImage2D, which may stall
+ * while the driver copies it. the other paths copy the dirty rows into one of UPLOAD_PBOS
+ * pixel buffers in rotation and upload from there, so the transfer to the texture happens
+ * asynchronously. UPLOAD_PBO maps the buffer every frame and lets the driver orphan it,
+ * UPLOAD_PERSISTENT maps the buffers once and fences each one until the gpu is done with it */
+s8 *upload_mode_names[UPLOAD_MODES] = { "direct", "pbo", "persistent" };
+u32 upload_mode = UPLOAD_PATH;
+u32 upload_pbos[UPLOAD_PBOS];
+u32 upload_persistent_pbos[UPLOAD_PBOS];
+u8 *upload_persistent_ptrs[UPLOAD_PBOS];
+GLsync upload_fences[UPLOAD_PBOS];
+u32 upload_next;
+b8 upload_persistent_supported;
+/* timing counters, printed at exit */
+f64 upload_time[UPLOAD_MODES];
+f64 upload_time_max[UPLOAD_MODES];
+u32 upload_frames[UPLOAD_MODES];
+u32 upload_fence_fallbacks;
+
+void
+init_upload(void) {
+  u32 i;
+  glGenBuffers(UPLOAD_PBOS, upload_pbos);
+  for (i = 0; i < UPLOAD_PBOS; i++) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_pbos[i]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, GAME_W * GAME_H, 0, GL_STREAM_DRAW);
+  }
+  upload_persistent_supported = glBufferStorage && glfwExtensionSupported("GL_ARB_buffer_storage");
+  if (upload_persistent_supported) {
+    glGenBuffers(UPLOAD_PBOS, upload_persistent_pbos);
+    for (i = 0; i < UPLOAD_PBOS; i++) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_persistent_pbos[i]);
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER, GAME_W * GAME_H, 0,
+          GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+      upload_persistent_ptrs[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, GAME_W * GAME_H,
+          GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+      if (!upload_persistent_ptrs[i]) upload_persistent_supported = 0;
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (upload_mode == UPLOAD_PERSISTENT && !upload_persistent_supported) upload_mode = UPLOAD_PBO;
+}
+
+void
+cycle_upload_mode(void) {
+  upload_mode = (upload_mode + 1) % UPLOAD_MODES;
+  if (upload_mode == UPLOAD_PERSISTENT && !upload_persistent_supported) upload_mode = UPLOAD_DIRECT;
+  fprintf(stderr, "upload: %s\n", upload_mode_names[upload_mode]);
+}
+
+/* uploads a rect of pixels, laid out like the screen */
+void
+upload_screen(const u8 *pixels, s32 x_min, s32 y_min, s32 x_max, s32 y_max) {
+  s32 y, w = x_max - x_min + 1, h = y_max - y_min + 1;
+  u32 offset = y_min * GAME_W + x_min, pbo = upload_next;
+  f64 time = glfwGetTime();
+  u8 *dst = 0;
+  if (upload_mode == UPLOAD_PERSISTENT) {
+    GLenum wait = GL_ALREADY_SIGNALED;
+    if (upload_fences[pbo]) wait = glClientWaitSync(upload_fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    if (wait == GL_ALREADY_SIGNALED || wait == GL_CONDITION_SATISFIED) {
+      if (upload_fences[pbo]) glDeleteSync(upload_fences[pbo]);
+      upload_fences[pbo] = 0;
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_persistent_pbos[pbo]);
+      dst = upload_persistent_ptrs[pbo];
+    } else {
+      /* the gpu may still read the buffer, its fence is kept and this frame goes direct */
+      upload_fence_fallbacks++;
+    }
+  } else if (upload_mode == UPLOAD_PBO) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_pbos[pbo]);
+    dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, GAME_W * GAME_H, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!dst) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+  if (dst) {
+    /* same layout as the screen so GL_UNPACK_ROW_LENGTH still applies */
+    for (y = 0; y < h; y++) memcpy(dst + offset + y * GAME_W, &pixels[offset + y * GAME_W], w);
+    if (upload_mode == UPLOAD_PBO) glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x_min, y_min, w, h, GL_RED, GL_UNSIGNED_BYTE, (void *)(size_t)offset);
+    if (upload_mode == UPLOAD_PERSISTENT) upload_fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    upload_next = (upload_next + 1) % UPLOAD_PBOS;
+  } else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x_min, y_min, w, h, GL_RED, GL_UNSIGNED_BYTE, &pixels[offset]);
+  }
+  time = glfwGetTime() - time;
+  upload_time[upload_mode] += time;
+  if (time > upload_time_max[upload_mode]) upload_time_max[upload_mode] = time;
+  upload_frames[upload_mode]++;
+}
+
+void
+print_upload_stats(void) {
+  u32 i;
+  for (i = 0; i < UPLOAD_MODES; i++) {
+    if (!upload_frames[i]) continue;
+    fprintf(stderr, "upload %-10s %6u uploads, avg %.1fus, max %.1fus\n", upload_mode_names[i], upload_frames[i],
+        upload_time[i] / upload_frames[i] * 1000000, upload_time_max[i] * 1000000);
+  }
+  if (upload_fence_fallbacks) fprintf(stderr, "upload %u frames went direct on a busy fence\n", upload_fence_fallbacks);
+}
+
+/* steps the simulation up to time and draws the frame, returns 0 when the screen didn't change */
+f64 frame_prv_time;
+f64 frame_accumulator;
+
+b8
+step_frame(f64 time) {
+  u32 steps = 0;
+  b8 changed;
+  frame_accumulator += time - frame_prv_time;
+  frame_prv_time = time;
+  /* logic */
+  profile_begin(PHASE_UPDATE);
+  while (frame_accumulator >= SIM_DT && steps < SIM_MAX_STEPS) {
+    simulate();
+    frame_accumulator -= SIM_DT;
+    steps++;
+  }
+  if (frame_accumulator >= SIM_DT) frame_accumulator = 0; /* too far behind, drop the backlog */
+  interpolate_render_state(frame_accumulator / SIM_DT * FX_ONE);
+  profile_end(PHASE_UPDATE);
+  /* rendering */
+  profile_begin(PHASE_CLEAR);
+  clear_screen(BLACK);
+  profile_end(PHASE_CLEAR);
+  profile_begin(PHASE_DRAW);
+  draw();
+#ifdef PROFILE
+  if (profile_hud) profile_draw_hud();
+#endif
+  profile_end(PHASE_DRAW);
+  profile_begin(PHASE_RASTER);
+  changed = flush_draw_cmds();
+  profile_end(PHASE_RASTER);
+  capture_push(steps);
+  return changed;
+}
+
+#ifdef PIPELINE
+/* a triple buffer: the worker fills the back frame and swaps it with the ready one, the main
+ * thread swaps the ready one with its front frame when it is fresh. the swaps are single atomic
+ * exchanges of pipeline_ready, which holds the index of the ready frame and PIPELINE_FRESH.
+ * the worker only starts a frame when the main thread took the last one and posted
+ * pipeline_request, so every frame gets presented and only its dirty rect has to be copied */
+#define PIPELINE_FRESH 0x4
+typedef struct {
+  u8 screen[GAME_W * GAME_H]; /* only the dirty rect is up to date */
+  b8 changed;
+  s32 x_min, y_min, x_max, y_max;
+  rgb palette[COLORS_AMOUNT];
+#ifdef PROFILE
+  f64 profile_begin_time[PHASE_UPLOAD];
+  f64 profile_duration[PHASE_UPLOAD];
+#endif
+} pipeline_frame;
+pipeline_frame pipeline_frames[PIPELINE_FRAMES];
+u32 pipeline_front; /* main thread */
+u32 pipeline_back;  /* worker */
+volatile u32 pipeline_ready;
+input pipeline_input; /* key_held when the frame was requested */
+volatile b8 pipeline_quit;
+sem_t pipeline_request;
+pthread_t pipeline_thread;
+
+void *
+pipeline_worker(void *arg) {
+  pipeline_frame *frame;
+  s32 y;
+  (void)arg;
+  for (;;) {
+    sem_wait(&pipeline_request);
+    if (pipeline_quit) break;
+    key_cur = pipeline_input;
+    frame = &pipeline_frames[pipeline_back];
+    frame->changed = step_frame(glfwGetTime());
+    if (frame->changed) {
+      frame->x_min = dirty_x_min;
+      frame->y_min = dirty_y_min;
+      frame->x_max = dirty_x_max;
+      frame->y_max = dirty_y_max;
+      for (y = dirty_y_min; y <= dirty_y_max; y++) {
+        memcpy(&frame->screen[y * GAME_W + dirty_x_min], &screen[y * GAME_W + dirty_x_min], dirty_x_max - dirty_x_min + 1);
+      }
+    }
+    memcpy(frame->palette, game.palette, sizeof (frame->palette));
+#ifdef PROFILE
+    memcpy(frame->profile_begin_time, profile_worker_begin_time, sizeof (frame->profile_begin_time));
+    memcpy(frame->profile_duration, profile_worker_duration, sizeof (frame->profile_duration));
+#endif
+    /* full barrier, the frame is written before it is published */
+    __sync_synchronize();
+    pipeline_back = __sync_lock_test_and_set(&pipeline_ready, pipeline_back | PIPELINE_FRESH) & ~PIPELINE_FRESH;
+  }
+  return 0;
+}
+
+void
+pipeline_start(void) {
+  pipeline_front = 0;
+  pipeline_ready = 1;
+  pipeline_back  = 2;
+  memcpy(pipeline_frames[0].palette, game.palette, sizeof (game.palette));
+  sem_init(&pipeline_request, 0, 0);
+  pipeline_input = key_held;
+  sem_post(&pipeline_request);
+  pthread_create(&pipeline_thread, 0, pipeline_worker, 0);
+}
+
+/* takes the ready frame when there is a new one and requests the next, returns 0 otherwise */
+b8
+pipeline_take(void) {
+  if (!(pipeline_ready & PIPELINE_FRESH)) {
+#ifdef PROFILE
+    memset(profile_duration[profile_frame % PROFILE_FRAMES], 0, sizeof (f64) * PHASE_UPLOAD);
+#endif
+    return 0;
+  }
+  pipeline_front = __sync_lock_test_and_set(&pipeline_ready, pipeline_front) & ~PIPELINE_FRESH;
+  __sync_synchronize();
+#ifdef PROFILE
+  memcpy(profile_begin_time[profile_frame % PROFILE_FRAMES], pipeline_frames[pipeline_front].profile_begin_time, sizeof (pipeline_frames[pipeline_front].profile_begin_time));
+  memcpy(profile_duration[profile_frame % PROFILE_FRAMES], pipeline_frames[pipeline_front].profile_duration, sizeof (pipeline_frames[pipeline_front].profile_duration));
+#endif
+  pipeline_input = key_held;
+  sem_post(&pipeline_request);
+  return 1;
+}
+
+void
+pipeline_stop(void) {
+  pipeline_quit = 1;
+  sem_post(&pipeline_request);
+  pthread_join(pipeline_thread, 0);
+  sem_destroy(&pipeline_request);
+}
+#endif
+
+#ifdef AUDIO_ALSA
+/* the device side, it blocks in the driver until a period fits and only then renders it, so
+ * what is queued ahead of a fresh period is the device buffer less that period */
+snd_pcm_t *audio_pcm;
+pthread_t audio_thread;
+b8 audio_quit;
+u32 audio_underruns;
+snd_pcm_sframes_t audio_delay_max; /* the most the device had queued ahead of a fresh period */
+
+void *
+audio_device_thread(void *arg) {
+  s16 period[AUDIO_PERIOD];
+  (void)arg;
+  while (!sync_load(audio_quit)) {
+    snd_pcm_sframes_t written, delay;
+    snd_pcm_wait(audio_pcm, 100);
+    audio_render(period, AUDIO_PERIOD);
+    if (snd_pcm_delay(audio_pcm, &delay) >= 0 && delay > audio_delay_max) audio_delay_max = delay;
+    written = snd_pcm_writei(audio_pcm, period, AUDIO_PERIOD);
+    if (written == -EPIPE) audio_underruns++;
+    if (written < 0) snd_pcm_recover(audio_pcm, written, 1);
+  }
+  return 0;
+}
+
+/* the game goes on silent when there is no device */
+void
+audio_start(void) {
+  snd_pcm_uframes_t buffer, period;
+  s32 err = snd_pcm_open(&audio_pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
+  if (err >= 0) {
+    err = snd_pcm_set_params(audio_pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1, AUDIO_RATE, 1,
+        AUDIO_PERIOD * 2 * 1000000 / AUDIO_RATE);
+    if (err < 0) snd_pcm_close(audio_pcm);
+  }
+  if (err < 0) {
+    fprintf(stderr, "warning: no audio: %s\n", snd_strerror(err));
+    audio_pcm = 0;
+    return;
+  }
+  /* the driver may round the buffer up */
+  if (snd_pcm_get_params(audio_pcm, &buffer, &period) >= 0 && buffer > AUDIO_RATE / SIM_HZ)
+    fprintf(stderr, "warning: audio buffer of %lu samples, over a frame\n", (unsigned long)buffer);
+  pthread_create(&audio_thread, 0, audio_device_thread, 0);
+}
+
+/* a sound waits at most a period to be rendered and then what the device had queued */
+void
+audio_stop(void) {
+  if (!audio_pcm) return;
+  __sync_lock_test_and_set(&audio_quit, 1);
+  pthread_join(audio_thread, 0);
+  snd_pcm_close(audio_pcm);
+  fprintf(stderr, "audio %u underruns, %u sounds dropped, latency at most %.1fms\n", audio_underruns,
+      audio_dropped, (AUDIO_PERIOD + audio_delay_max) * 1000.0 / AUDIO_RATE);
+}
+#endif
+
+/* usage: gb11 [-pack <file>] [-record <file> | -replay <file>] [-capture <file>]
+ * the keyboard takes over again when a replay runs out, -capture needs -DCAPTURE */
 s32
-main(void) {
+main(s32 argc, s8 **argv) {
   /* variables */
   GLFWwindow *window;
+  s32 arg;
   const GLFWvidmode *vidmode;
   u32 shader;
   u32 vao, vbo, ibo;
   u32 screen_tex;
+  s32 palette_loc;
 
   /* init stuff */
+  for (arg = 1; arg + 1 < argc; arg += 2) {
+    if (!pack_option(argv[arg], argv[arg + 1]) && !replay_option(argv[arg], argv[arg + 1]) &&
+        !capture_option(argv[arg], argv[arg + 1])) break;
+  }
+  if (arg < argc) {
+    fprintf(stderr, "usage: %s [-pack <file>] [-record <file> | -replay <file>]" CAPTURE_USAGE "\n", argv[0]);
+    return EXIT_USAGE;
+  }
+  if (!load_pack(pack_path)) return EXIT_PACK;
   if (!glfwInit()) {
     const s8 *desc;
     glfwGetError(&desc);
@@ -972,6 +3144,7 @@ main(void) {
   vidmode = glfwGetVideoMode(glfwGetPrimaryMonitor());
   glfwSetWindowPos(window, (vidmode->width >> 1) - (WINDOW_W >> 1), (vidmode->height >> 1) - (WINDOW_H >> 1));
   glfwMakeContextCurrent(window);
+  glfwSwapInterval(FRAME_PACING == PACING_VSYNC);
 
   /* load opengl stuff */
   glClear                    = (gl_clear_fn *)glfwGetProcAddress("glClear");
@@ -1000,6 +3173,15 @@ main(void) {
   glTexParameteri            = (gl_tex_parameteri_fn *)glfwGetProcAddress("glTexParameteri");
   glTexImage2D               = (gl_tex_image_2d *)glfwGetProcAddress("glTexImage2D");
   glTexSubImage2D            = (gl_tex_sub_image_2d *)glfwGetProcAddress("glTexSubImage2D");
+  glGetUniformLocation       = (gl_get_uniform_location_fn *)glfwGetProcAddress("glGetUniformLocation");
+  glUniform3fv               = (gl_uniform_3fv_fn *)glfwGetProcAddress("glUniform3fv");
+  glPixelStorei              = (gl_pixel_storei_fn *)glfwGetProcAddress("glPixelStorei");
+  glMapBufferRange           = (gl_map_buffer_range_fn *)glfwGetProcAddress("glMapBufferRange");
+  glUnmapBuffer              = (gl_unmap_buffer_fn *)glfwGetProcAddress("glUnmapBuffer");
+  glBufferStorage            = (gl_buffer_storage_fn *)glfwGetProcAddress("glBufferStorage");
+  glFenceSync                = (gl_fence_sync_fn *)glfwGetProcAddress("glFenceSync");
+  glClientWaitSync           = (gl_client_wait_sync_fn *)glfwGetProcAddress("glClientWaitSync");
+  glDeleteSync               = (gl_delete_sync_fn *)glfwGetProcAddress("glDeleteSync");
 
   /* make shader */
   {
@@ -1056,30 +3238,99 @@ main(void) {
   glBindTexture(GL_TEXTURE_2D, screen_tex);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, GAME_W, GAME_H, 0, GL_RGBA, GL_UNSIGNED_BYTE, screen);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, GAME_W, GAME_H, 0, GL_RED, GL_UNSIGNED_BYTE, screen);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, GAME_W);
+  palette_loc = glGetUniformLocation(shader, "pal");
+  init_upload();
 
   {
-    f32 prv_time = glfwGetTime();
+    u32 i;
+    b8 b;
+    const u8 *pixels;
+    const rgb *palette;
+    s32 x_min, y_min, x_max, y_max;
+    f64 next_frame_time = glfwGetTime();
     init();
+    frame_prv_time = next_frame_time;
+#ifdef AUDIO_ALSA
+    audio_start();
+#endif
+#ifdef PIPELINE
+    pipeline_start();
+#endif
     while (!glfwWindowShouldClose(window)) {
-      /* timing */
-      f32 dt = glfwGetTime() - prv_time;
-      prv_time = glfwGetTime();
-      /* logic */
-      update(dt);
-      /* rendering */
-      clear_screen(BLACK);
-      draw();
-      /* internal rendering/input */
-      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GAME_W, GAME_H, GL_RGBA, GL_UNSIGNED_BYTE, screen);
+#ifdef PIPELINE
+      /* the worker updates and draws the next frame meanwhile */
+      const pipeline_frame *frame;
+      b = pipeline_take();
+      frame = &pipeline_frames[pipeline_front];
+      b = b && frame->changed;
+      pixels = frame->screen;
+      palette = frame->palette;
+      x_min = frame->x_min;
+      y_min = frame->y_min;
+      x_max = frame->x_max;
+      y_max = frame->y_max;
+#else
+      key_cur = key_held;
+      b = step_frame(glfwGetTime());
+      pixels = screen;
+      palette = game.palette;
+      x_min = dirty_x_min;
+      y_min = dirty_y_min;
+      x_max = dirty_x_max;
+      y_max = dirty_y_max;
+#endif
+      profile_begin(PHASE_UPLOAD);
+      if (upload_cycle_requested) {
+        upload_cycle_requested = 0;
+        cycle_upload_mode();
+      }
+      if (b) upload_screen(pixels, x_min, y_min, x_max, y_max);
+      {
+        f32 pal[COLORS_AMOUNT * 3];
+        for (i = 0; i < COLORS_AMOUNT; i++) {
+          pal[i * 3 + 0] = ((palette[i] >>  0) & 0xff) / 255.0f;
+          pal[i * 3 + 1] = ((palette[i] >>  8) & 0xff) / 255.0f;
+          pal[i * 3 + 2] = ((palette[i] >> 16) & 0xff) / 255.0f;
+        }
+        glUniform3fv(palette_loc, COLORS_AMOUNT, pal);
+      }
       glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+      profile_end(PHASE_UPLOAD);
+      profile_begin(PHASE_SWAP);
       glfwSwapBuffers(window);
-      key_prv = key_cur;
+#if FRAME_PACING == PACING_CAPPED
+      next_frame_time += 1.0 / FRAME_CAP_HZ;
+      if (next_frame_time < glfwGetTime()) next_frame_time = glfwGetTime();
+      while (glfwGetTime() < next_frame_time) glfwWaitEventsTimeout(next_frame_time - glfwGetTime());
+#else
+      (void)next_frame_time;
+#endif
       glfwPollEvents();
+      profile_end(PHASE_SWAP);
+      profile_next_frame();
+#ifdef PROFILE
+      if (profile_export_requested) {
+        profile_export_requested = 0;
+        profile_export_trace();
+      }
+#endif
     }
+#ifdef PIPELINE
+    pipeline_stop();
+#endif
+    capture_close();
+#ifdef AUDIO_ALSA
+    audio_stop();
+#endif
   }
 
   /* exit glfw */
+  replay_close();
+  print_upload_stats();
   glfwTerminate();
   return 0;
 }
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 typedef char           s8;
 typedef short          s16;
@@ -8,57 +9,188 @@ typedef unsigned char  u8;
 typedef unsigned short u16;
 typedef unsigned int   u32;
 
+/* keep these in sync with main.c */
+#define ATLAS_TW        16
+#define ATLAS_TILES_CAP 256
+#define TILE_SIZE       8
+#define TRANSPARENT     4
+
+#define TGA_HEADER_SIZE 18
+#define TGA_RAW         2
+#define TGA_RLE         10
+
+typedef struct {
+  u32 w, h;
+  u32 *pixels; /* 0xaarrggbb, top row first */
+} sheet;
+
+u32
+read_u16(const u8 *p) {
+  return p[0] | (p[1] << 8);
+}
+
+/* returns the color index, TRANSPARENT, or -1 for a color that isn't in the palette */
+s32
+color_index(u32 pixel) {
+  if (!(pixel >> 24)) return TRANSPARENT;
+  switch (pixel & 0xffffff) {
+    case 0xffffff: return 0;
+    case 0xcccccc: return 1;
+    case 0x999999: return 2;
+    case 0x666666: return 3;
+    case 0x000000: return TRANSPARENT;
+    default:       return -1;
+  }
+}
+
+/* uncompressed or rle true color tga, 24 or 32 bits, any origin */
 s32
-main(void) {
-  u16 w, h;
+load_tga(const s8 *path, sheet *out) {
+  u8 *data, *p, *end;
+  u32 size, type, bpp, descriptor, i, x, y, pixels_amount;
   u32 *pixels;
-  u16 i;
-  FILE *out = fopen("atlas.h", "w");
-  FILE *in  = fopen("./res/imgs/atlas.tga", "rb");
-  if (!out) {
-    printf("out\n");
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    fprintf(stderr, "error: couldn't open '%s'\n", path);
+    return 0;
+  }
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  data = malloc(size);
+  if (!data || fread(data, 1, size, in) != size) {
+    fprintf(stderr, "error: couldn't read '%s'\n", path);
+    return 0;
+  }
+  fclose(in);
+  if (size < TGA_HEADER_SIZE) {
+    fprintf(stderr, "%s: error: truncated header\n", path);
+    return 0;
+  }
+  type       = data[2];
+  out->w     = read_u16(data + 12);
+  out->h     = read_u16(data + 14);
+  bpp        = data[16] >> 3;
+  descriptor = data[17];
+  if (data[1] || (type != TGA_RAW && type != TGA_RLE) || (bpp != 3 && bpp != 4)) {
+    fprintf(stderr, "%s: error: only 24 or 32 bit true color images are supported\n", path);
+    return 0;
+  }
+  p   = data + TGA_HEADER_SIZE + data[0];
+  end = data + size;
+  pixels_amount = out->w * out->h;
+  pixels = malloc(sizeof (u32) * pixels_amount);
+  out->pixels = malloc(sizeof (u32) * pixels_amount);
+  for (i = 0; i < pixels_amount;) {
+    u32 count = 1, raw = 1, j;
+    if (type == TGA_RLE) {
+      if (p >= end) break;
+      count = (*p & 0x7f) + 1;
+      raw   = !(*p & 0x80);
+      p++;
+    }
+    for (j = 0; j < count && i < pixels_amount; j++, i++) {
+      if (raw || !j) {
+        if (p + bpp > end) break;
+        pixels[i] = p[0] | (p[1] << 8) | (p[2] << 16) | (bpp == 4 ? (u32)p[3] << 24 : 0xff000000);
+        p += bpp;
+      } else {
+        pixels[i] = pixels[i - 1];
+      }
+    }
+    if (j < count && i < pixels_amount) break;
+  }
+  if (i < pixels_amount) {
+    fprintf(stderr, "%s: error: truncated pixel data\n", path);
+    return 0;
+  }
+  /* bit 5 of the descriptor is a top origin, bit 4 a right origin */
+  for (y = 0; y < out->h; y++) {
+    for (x = 0; x < out->w; x++) {
+      u32 sx = descriptor & 0x10 ? out->w - 1 - x : x;
+      u32 sy = descriptor & 0x20 ? y : out->h - 1 - y;
+      out->pixels[y * out->w + x] = pixels[sy * out->w + sx];
+    }
+  }
+  free(pixels);
+  free(data);
+  return 1;
+}
+
+/* usage: make_atlas <out.bin> <sheet.tga>...
+ * every sheet is ATLAS_TW tiles wide, their tile rows are appended in order */
+s32
+main(s32 argc, s8 **argv) {
+  u32 tiles = 0, header[4], size, i, t, x, y;
+  u8 *blob, *planes, *masks;
+  sheet sheets[ATLAS_TILES_CAP / ATLAS_TW];
+  FILE *out;
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <out.bin> <sheet.tga>...\n", argv[0]);
     return 1;
   }
-  if (!in) {
-    printf("in\n");
+  if ((u32)argc - 2 > sizeof (sheets) / sizeof (sheet)) {
+    fprintf(stderr, "error: too many sheets\n");
     return 1;
   }
-  fseek(in, 12, SEEK_CUR);
-  fread(&w, sizeof (u16), 1, in);
-  fread(&h, sizeof (u16), 1, in);
-  fseek(in, 2, SEEK_CUR);
-  printf("w: %u, h: %u\n", w, h);
-  pixels = malloc(sizeof (u32) * w * h);
-  fread(pixels, sizeof (u32), w * h, in);
-  fprintf(out, "#ifndef __ATLAS_H__\n");
-  fprintf(out, "#define __ATLAS_H__\n");
-  fprintf(out, "#define ATLAS_W %u\n", w);
-  fprintf(out, "#define ATLAS_H %u\n", h);
-  fprintf(out, "static u8 atlas[ATLAS_W * ATLAS_H] = {");
-  for (i = 0; i < w * h; i++) {
-    switch (pixels[i]) {
-      case 0xffffffff:
-        fprintf(out, "0");
-        break;
-      case 0xffcccccc:
-        fprintf(out, "1");
-        break;
-      case 0xff999999:
-        fprintf(out, "2");
-        break;
-      case 0xff666666:
-        fprintf(out, "3");
-        break;
-      default:
-        fprintf(out, "4");
-        break;
+  for (i = 0; i < (u32)argc - 2; i++) {
+    if (!load_tga(argv[2 + i], &sheets[i])) return 1;
+    if (sheets[i].w != ATLAS_TW * TILE_SIZE || !sheets[i].h || sheets[i].h % TILE_SIZE) {
+      fprintf(stderr, "%s: error: sheet is %ux%u, it must be %u wide and a multiple of %u high\n",
+          argv[2 + i], sheets[i].w, sheets[i].h, ATLAS_TW * TILE_SIZE, TILE_SIZE);
+      return 1;
     }
-    if (i < w * h - 1) fprintf(out, ",");
+    tiles += ATLAS_TW * (sheets[i].h / TILE_SIZE);
+  }
+  if (tiles > ATLAS_TILES_CAP) {
+    fprintf(stderr, "error: %u tiles, the cap is %u\n", tiles, ATLAS_TILES_CAP);
+    return 1;
+  }
+  /* atlas blob: u32 w, h, tiles and padding, then the 2bpp planar tiles (per row one byte of low bits
+   * and one of high bits, msb is the leftmost pixel), then the 1bpp masks (a set bit is an opaque pixel) */
+  size   = sizeof (header) + tiles * TILE_SIZE * 3;
+  blob   = calloc(size, 1);
+  planes = blob + sizeof (header);
+  masks  = planes + tiles * TILE_SIZE * 2;
+  t = 0;
+  for (i = 0; i < (u32)argc - 2; i++) {
+    u32 sheet_tiles = ATLAS_TW * (sheets[i].h / TILE_SIZE);
+    u32 st;
+    for (st = 0; st < sheet_tiles; st++, t++) {
+      for (y = 0; y < TILE_SIZE; y++) {
+        u8 lo = 0, hi = 0, mask = 0;
+        for (x = 0; x < TILE_SIZE; x++) {
+          u32 px = (st % ATLAS_TW) * TILE_SIZE + x;
+          u32 py = (st / ATLAS_TW) * TILE_SIZE + y;
+          s32 c = color_index(sheets[i].pixels[py * sheets[i].w + px]);
+          if (c < 0) {
+            fprintf(stderr, "%s:%u,%u: error: color #%06x isn't in the palette\n",
+                argv[2 + i], px, py, sheets[i].pixels[py * sheets[i].w + px] & 0xffffff);
+            return 1;
+          }
+          if (c == TRANSPARENT) continue;
+          lo   |= (c & 1) << (7 - x);
+          hi   |= (c >> 1) << (7 - x);
+          mask |= 1 << (7 - x);
+        }
+        planes[t * TILE_SIZE * 2 + y * 2]     = lo;
+        planes[t * TILE_SIZE * 2 + y * 2 + 1] = hi;
+        masks[t * TILE_SIZE + y]              = mask;
+      }
+    }
+    free(sheets[i].pixels);
+  }
+  header[0] = ATLAS_TW * TILE_SIZE;
+  header[1] = (tiles / ATLAS_TW) * TILE_SIZE;
+  header[2] = tiles;
+  header[3] = 0;
+  memcpy(blob, header, sizeof (header));
+  out = fopen(argv[1], "wb");
+  if (!out || fwrite(blob, 1, size, out) != size) {
+    fprintf(stderr, "error: couldn't write '%s'\n", argv[1]);
+    return 1;
   }
-  fprintf(out, "};\n");
-  fprintf(out, "#endif/*__ATLAS_H__*/\n");
-  free(pixels);
   fclose(out);
-  fclose(in);
+  free(blob);
   return 0;
 }
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef char           s8;
+typedef short          s16;
+typedef int            s32;
+typedef unsigned char  u8;
+typedef unsigned short u16;
+typedef unsigned int   u32;
+
+/* keep these in sync with main.c */
+#define LVL_MAX_W 256
+#define LVL_MAX_H 256
+#define LVL_CHUNK 16
+#define LEVEL_ENTITIES_CAP 4096
+#define BEGIN_TXT_LINES_CAP 5
+#define LEVEL_ENTITY_ARROW 0
+#define D_UP    0
+#define D_LEFT  1
+#define D_RIGHT 2
+#define D_DOWN  3
+
+#define PACK_MAGIC     "GB11PACK"
+#define PACK_VERSION   2
+#define PACK_NAME_SIZE 16
+#define PACK_ALIGN     4096
+
+#define LEVELS_CAP   256
+#define CHUNKS_CAP   ((LVL_MAX_W / LVL_CHUNK) * (LVL_MAX_H / LVL_CHUNK))
+#define ENTITIES_CAP (LEVELS_CAP * LEVEL_ENTITIES_CAP)
+#define LINE_CAP     512
+#define BLOB_CAP     (sizeof (pack_level) + (CHUNKS_CAP + 1) * sizeof (u16) + \
+    LEVEL_ENTITIES_CAP * sizeof (level_entity) + BEGIN_TXT_LINES_CAP * LINE_CAP)
+
+/* pack layout: pack_header, entries_amount pack_entry, then every blob aligned to PACK_ALIGN */
+typedef struct {
+  s8 magic[8];
+  u32 version;
+  u32 entries_amount;
+} pack_header;
+
+typedef struct {
+  s8 name[PACK_NAME_SIZE];
+  u32 offset, size;
+} pack_entry;
+
+/* level blob: pack_level, then the chunk table, then entities_amount level_entity sorted by chunk,
+ * then the nul terminated begin text lines. the chunk table has a u16 per LVL_CHUNK x LVL_CHUNK
+ * chunk from the origin to the far corner of the map, row by row, with the index of its first
+ * entity, and then the entities amount */
+typedef struct {
+  u16 x, y, w, h;
+  u8 player_x, player_y;
+  u8 door_x, door_y;
+  u8 key_x, key_y;
+  u8 begin_txt_lines;
+  u8 pad;
+  u16 entities_amount;
+  u16 begin_txt[BEGIN_TXT_LINES_CAP]; /* offsets from the start of the blob */
+} pack_level;
+
+typedef struct {
+  u32 x, y;
+  u32 w, h;
+  s8 begin_txt[BEGIN_TXT_LINES_CAP][LINE_CAP];
+  u32 begin_txt_lines;
+  s32 player_x, player_y;
+  s32 door_x, door_y;
+  s32 key_x, key_y;
+  u32 entities_offset, entities_amount;
+} level;
+
+typedef struct {
+  u8 type, arg;
+  u8 x, y;
+} level_entity;
+
+level levels[LEVELS_CAP];
+level_entity entities[ENTITIES_CAP];
+u32 entities_amount;
+
+/* level sources are text files:
+ *   pos <x> <y>      position of the map in the world, in tiles
+ *   text <line>      begin text line, up to BEGIN_TXT_LINES_CAP
+ *   map              the rest of the file are the map rows:
+ *                    '.' floor, 'p' player, 'd' door, 'k' key, '^' '<' '>' 'v' arrows */
+s32
+parse_level(const s8 *path, level *lvl) {
+  s8 line[LINE_CAP];
+  u32 line_num = 0, in_map = 0, x;
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "error: couldn't open '%s'\n", path);
+    return 0;
+  }
+  lvl->player_x = lvl->door_x = lvl->key_x = -1;
+  lvl->entities_offset = entities_amount;
+  while (fgets(line, LINE_CAP, in)) {
+    u32 len = strlen(line);
+    line_num++;
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+    if (!in_map) {
+      if (!len) continue;
+      if (sscanf(line, "pos %u %u", &lvl->x, &lvl->y) == 2) continue;
+      if (!strncmp(line, "text ", 5)) {
+        if (lvl->begin_txt_lines == BEGIN_TXT_LINES_CAP) {
+          fprintf(stderr, "%s:%u: error: more than %u text lines\n", path, line_num, BEGIN_TXT_LINES_CAP);
+          return 0;
+        }
+        strcpy(lvl->begin_txt[lvl->begin_txt_lines++], line + 5);
+        continue;
+      }
+      if (!strcmp(line, "map")) {
+        in_map = 1;
+        continue;
+      }
+      fprintf(stderr, "%s:%u: error: unknown directive '%s'\n", path, line_num, line);
+      return 0;
+    }
+    if (!len) continue;
+    if (lvl->w && len != lvl->w) {
+      fprintf(stderr, "%s:%u: error: row is %u wide, expected %u\n", path, line_num, len, lvl->w);
+      return 0;
+    }
+    lvl->w = len;
+    for (x = 0; x < len; x++) {
+      s32 tx = lvl->x + x, ty = lvl->y + lvl->h;
+      level_entity *e = &entities[entities_amount];
+      switch (line[x]) {
+        case '.': break;
+        case 'p': lvl->player_x = tx; lvl->player_y = ty; break;
+        case 'd': lvl->door_x   = tx; lvl->door_y   = ty; break;
+        case 'k': lvl->key_x    = tx; lvl->key_y    = ty; break;
+        case '^': case '<': case '>': case 'v':
+          if (lvl->entities_amount == LEVEL_ENTITIES_CAP) {
+            fprintf(stderr, "%s:%u: error: more than %u entities\n", path, line_num, LEVEL_ENTITIES_CAP);
+            return 0;
+          }
+          e->type = LEVEL_ENTITY_ARROW;
+          e->arg  = line[x] == '^' ? D_UP : line[x] == '<' ? D_LEFT : line[x] == '>' ? D_RIGHT : D_DOWN;
+          e->x    = tx;
+          e->y    = ty;
+          entities_amount++;
+          lvl->entities_amount++;
+          break;
+        default:
+          fprintf(stderr, "%s:%u: error: unknown map cell '%c'\n", path, line_num, line[x]);
+          return 0;
+      }
+    }
+    lvl->h++;
+  }
+  fclose(in);
+  if (!lvl->w || lvl->x + lvl->w > LVL_MAX_W || lvl->y + lvl->h > LVL_MAX_H) {
+    fprintf(stderr, "%s: error: map must be between 1x1 and %ux%u tiles including its position\n", path, LVL_MAX_W, LVL_MAX_H);
+    return 0;
+  }
+  if (lvl->player_x < 0 || lvl->door_x < 0 || lvl->key_x < 0) {
+    fprintf(stderr, "%s: error: map needs a player, a door and a key\n", path);
+    return 0;
+  }
+  return 1;
+}
+
+u32
+serialize_level(const level *lvl, u8 *blob) {
+  pack_level *out = (pack_level *)blob;
+  u16 *table = (u16 *)(out + 1);
+  level_entity *sorted;
+  u32 size, i, chunks_w = (lvl->x + lvl->w + LVL_CHUNK - 1) / LVL_CHUNK;
+  u32 chunks = chunks_w * ((lvl->y + lvl->h + LVL_CHUNK - 1) / LVL_CHUNK);
+  memset(blob, 0, BLOB_CAP);
+  out->x = lvl->x;
+  out->y = lvl->y;
+  out->w = lvl->w;
+  out->h = lvl->h;
+  out->player_x = lvl->player_x;
+  out->player_y = lvl->player_y;
+  out->door_x = lvl->door_x;
+  out->door_y = lvl->door_y;
+  out->key_x = lvl->key_x;
+  out->key_y = lvl->key_y;
+  out->begin_txt_lines = lvl->begin_txt_lines;
+  out->entities_amount = lvl->entities_amount;
+  /* counting sort of the entities by chunk, the counts turn into the table */
+  for (i = 0; i < lvl->entities_amount; i++) {
+    const level_entity *e = &entities[lvl->entities_offset + i];
+    table[(e->y / LVL_CHUNK) * chunks_w + e->x / LVL_CHUNK + 1]++;
+  }
+  for (i = 0; i < chunks; i++) table[i + 1] += table[i];
+  size = sizeof (pack_level) + (chunks + 1) * sizeof (u16);
+  sorted = (level_entity *)(blob + size);
+  for (i = 0; i < lvl->entities_amount; i++) {
+    const level_entity *e = &entities[lvl->entities_offset + i];
+    sorted[table[(e->y / LVL_CHUNK) * chunks_w + e->x / LVL_CHUNK]++] = *e;
+  }
+  /* the placement moved every start to the next chunk's */
+  for (i = chunks; i; i--) table[i] = table[i - 1];
+  table[0] = 0;
+  size += lvl->entities_amount * sizeof (level_entity);
+  for (i = 0; i < lvl->begin_txt_lines; i++) {
+    out->begin_txt[i] = size;
+    strcpy((s8 *)blob + size, lvl->begin_txt[i]);
+    size += strlen(lvl->begin_txt[i]) + 1;
+  }
+  return size;
+}
+
+void
+write_padding(FILE *out, u32 *offset) {
+  while (*offset % PACK_ALIGN) {
+    fputc(0, out);
+    (*offset)++;
+  }
+}
+
+s32
+main(s32 argc, s8 **argv) {
+  static u8 blob[BLOB_CAP];
+  pack_header header;
+  pack_entry *entries;
+  u8 *atlas;
+  u32 atlas_size, levels_amount, offset, i;
+  FILE *in, *out;
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s <out.pack> <atlas.bin> <level>...\n", argv[0]);
+    return 1;
+  }
+  levels_amount = argc - 3;
+  if (levels_amount > LEVELS_CAP) {
+    fprintf(stderr, "error: too many levels, the cap is %u\n", LEVELS_CAP);
+    return 1;
+  }
+  for (i = 0; i < levels_amount; i++) {
+    if (!parse_level(argv[3 + i], &levels[i])) return 1;
+  }
+  /* atlas blob, as written by make_atlas */
+  in = fopen(argv[2], "rb");
+  if (!in) {
+    fprintf(stderr, "error: couldn't open '%s'\n", argv[2]);
+    return 1;
+  }
+  fseek(in, 0, SEEK_END);
+  atlas_size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  atlas = malloc(atlas_size);
+  if (fread(atlas, 1, atlas_size, in) != atlas_size) {
+    fprintf(stderr, "error: couldn't read '%s'\n", argv[2]);
+    return 1;
+  }
+  fclose(in);
+  /* table of contents, the blob offsets are filled in as they are written */
+  memcpy(header.magic, PACK_MAGIC, sizeof (header.magic));
+  header.version = PACK_VERSION;
+  header.entries_amount = 1 + levels_amount;
+  entries = calloc(header.entries_amount, sizeof (pack_entry));
+  strcpy(entries[0].name, "atlas");
+  for (i = 0; i < levels_amount; i++) strcpy(entries[1 + i].name, "level");
+  out = fopen(argv[1], "wb");
+  if (!out) {
+    fprintf(stderr, "error: couldn't open '%s'\n", argv[1]);
+    return 1;
+  }
+  fwrite(&header, sizeof (header), 1, out);
+  fwrite(entries, sizeof (pack_entry), header.entries_amount, out);
+  offset = sizeof (header) + sizeof (pack_entry) * header.entries_amount;
+  write_padding(out, &offset);
+  entries[0].offset = offset;
+  entries[0].size = atlas_size;
+  fwrite(atlas, 1, atlas_size, out);
+  offset += atlas_size;
+  for (i = 0; i < levels_amount; i++) {
+    u32 size = serialize_level(&levels[i], blob);
+    write_padding(out, &offset);
+    entries[1 + i].offset = offset;
+    entries[1 + i].size = size;
+    fwrite(blob, 1, size, out);
+    offset += size;
+  }
+  fseek(out, sizeof (header), SEEK_SET);
+  fwrite(entries, sizeof (pack_entry), header.entries_amount, out);
+  fclose(out);
+  free(entries);
+  free(atlas);
+  return 0;
+}
@@ -0,0 +1,366 @@
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef char           b8;
+typedef char           s8;
+typedef short          s16;
+typedef int            s32;
+typedef unsigned char  u8;
+typedef unsigned short u16;
+typedef unsigned int   u32;
+typedef double         f64;
+
+/* keep these in sync with main.c and make_pack.c */
+#define LVL_MAX_W 256
+#define LVL_MAX_H 256
+#define LVL_CHUNK 16
+#define LEVELS_CAP 256
+#define LEVEL_ENTITIES_CAP 4096
+#define BEGIN_TXT_LINES_CAP 5
+#define LEVEL_ENTITY_ARROW 0
+#define D_UP    0
+#define D_LEFT  1
+#define D_RIGHT 2
+#define D_DOWN  3
+
+#define PACK_MAGIC     "GB11PACK"
+#define PACK_VERSION   2
+#define PACK_NAME_SIZE 16
+
+#define THREADS_CAP 64
+#define STATES_CAP  (1 << 21) /* default, -s overrides it */
+#define CHUNK       256 /* states a worker takes from the layer at once */
+#define NO_PARENT   0xffffffff
+#define DEAD        0xff /* move of a state that lost an insertion race to an equal one */
+
+typedef struct {
+  s8 magic[8];
+  u32 version;
+  u32 entries_amount;
+} pack_header;
+
+typedef struct {
+  s8 name[PACK_NAME_SIZE];
+  u32 offset, size;
+} pack_entry;
+
+typedef struct {
+  u16 x, y, w, h;
+  u8 player_x, player_y;
+  u8 door_x, door_y;
+  u8 key_x, key_y;
+  u8 begin_txt_lines;
+  u8 pad;
+  u16 entities_amount;
+  u16 begin_txt[BEGIN_TXT_LINES_CAP];
+} pack_level;
+
+typedef struct {
+  u8 type, arg;
+  u8 x, y;
+} level_entity;
+
+#define level_chunks(L)   (((L)->x + (L)->w + LVL_CHUNK - 1) / LVL_CHUNK * (((L)->y + (L)->h + LVL_CHUNK - 1) / LVL_CHUNK))
+#define level_entities(L) ((const level_entity *)((const u16 *)((L) + 1) + level_chunks(L) + 1))
+
+/* a search state, followed by one bit per arrow of the level that was collected.
+ * everything is in tiles, the room is [x_min, x_max) x [y_min, y_max) */
+typedef struct {
+  s16 player_x, player_y;
+  s16 x_min, y_min, x_max, y_max;
+  u8 key_collected;
+  u8 pad;
+} state;
+
+/* the arena holds records of u32 parent, u8 move and padding, followed by the state */
+#define RECORD_HEADER 8
+#define record(I)        (arena + (size_t)(I) * record_size)
+#define record_parent(I) (*(u32 *)record(I))
+#define record_move(I)   (record(I)[4])
+#define record_state(I)  (record(I) + RECORD_HEADER)
+
+/* the level being solved */
+const pack_level *lvl;
+s16 arrow_at[LVL_MAX_H][LVL_MAX_W]; /* index into arrow_dir or -1 */
+u8 arrow_dir[LEVEL_ENTITIES_CAP];
+u32 state_size, record_size;
+
+/* the search, one breadth-first layer at a time. the workers share the arena and the
+ * visited set, both are filled without locks: a record is written before its index is
+ * published in the table with a compare and swap */
+u8 *arena;
+u32 states_cap;
+volatile u32 states_amount;
+volatile u32 *table; /* record index + 1, or 0 when empty */
+u32 table_mask;
+volatile u32 cursor;
+u32 layer_end;
+volatile u32 solution_found, solution_parent, solution_move;
+volatile u32 out_of_states;
+
+typedef struct {
+  pthread_t thread;
+  u32 expanded, legal, added;
+} worker;
+worker workers[THREADS_CAP];
+u32 threads_amount;
+
+u32
+hash_state(const u8 *s) {
+  u32 i, hash = 2166136261u;
+  for (i = 0; i < state_size; i++) hash = (hash ^ s[i]) * 16777619u;
+  return hash;
+}
+
+/* returns 1 when the state wasn't visited yet */
+b8
+visit(const u8 *s, u32 parent, u32 move) {
+  u32 slot = hash_state(s) & table_mask, idx = NO_PARENT, v;
+  for (;; slot = (slot + 1) & table_mask) {
+    v = table[slot];
+    if (!v) {
+      if (idx == NO_PARENT) {
+        idx = __sync_fetch_and_add(&states_amount, 1);
+        if (idx >= states_cap) {
+          out_of_states = 1;
+          return 0;
+        }
+        record_parent(idx) = parent;
+        record_move(idx) = move;
+        memcpy(record_state(idx), s, state_size);
+      }
+      if (__sync_bool_compare_and_swap(&table[slot], 0, idx + 1)) return 1;
+      v = table[slot];
+    }
+    if (!memcmp(record_state(v - 1), s, state_size)) {
+      if (idx != NO_PARENT) record_move(idx) = DEAD;
+      return 0;
+    }
+  }
+}
+
+/* the rules of player_setup_movement and player_move in main.c, in tiles: a step has to land
+ * in the room and not on the door while it's locked, the room then loses the row or column the
+ * player left. the key is picked up, an arrow grows the room by one tile towards its direction */
+void
+expand(worker *w, u32 idx) {
+  static const s8 dx[4] = { 0, -1, 1, 0 }, dy[4] = { -1, 0, 0, 1 };
+  u8 buf[sizeof (state) + LEVEL_ENTITIES_CAP / 8 + 1];
+  const state *cur = (const state *)record_state(idx);
+  state *next = (state *)buf;
+  u32 d;
+  w->expanded++;
+  for (d = 0; d < 4; d++) {
+    s32 nx = cur->player_x + dx[d], ny = cur->player_y + dy[d];
+    s32 arrow;
+    if (nx < cur->x_min || nx >= cur->x_max || ny < cur->y_min || ny >= cur->y_max) continue;
+    if (!cur->key_collected && nx == lvl->door_x && ny == lvl->door_y) continue;
+    w->legal++;
+    if (nx == lvl->door_x && ny == lvl->door_y) {
+      if (__sync_bool_compare_and_swap(&solution_found, 0, 1)) {
+        solution_parent = idx;
+        solution_move = d;
+      }
+      continue;
+    }
+    memcpy(buf, cur, state_size);
+    next->player_x = nx;
+    next->player_y = ny;
+    switch (d) {
+      case D_UP:    next->y_max--; break;
+      case D_LEFT:  next->x_max--; break;
+      case D_RIGHT: next->x_min++; break;
+      case D_DOWN:  next->y_min++; break;
+    }
+    if (nx == lvl->key_x && ny == lvl->key_y) next->key_collected = 1;
+    arrow = nx >= 0 && ny >= 0 && nx < LVL_MAX_W && ny < LVL_MAX_H ? arrow_at[ny][nx] : -1;
+    if (arrow >= 0 && !(buf[sizeof (state) + arrow / 8] & (1 << (arrow % 8)))) {
+      buf[sizeof (state) + arrow / 8] |= 1 << (arrow % 8);
+      switch (arrow_dir[arrow]) {
+        case D_UP:    next->y_min--; break;
+        case D_LEFT:  next->x_min--; break;
+        case D_RIGHT: next->x_max++; break;
+        case D_DOWN:  next->y_max++; break;
+      }
+    }
+    if (visit(buf, idx, d)) w->added++;
+  }
+}
+
+void *
+work(void *arg) {
+  worker *w = arg;
+  for (;;) {
+    u32 i, begin = __sync_fetch_and_add(&cursor, CHUNK), end;
+    if (begin >= layer_end || out_of_states) break;
+    end = begin + CHUNK < layer_end ? begin + CHUNK : layer_end;
+    for (i = begin; i < end; i++) {
+      if (record_move(i) != DEAD) expand(w, i);
+    }
+  }
+  return 0;
+}
+
+f64
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* returns 1 when the level is solvable */
+b8
+solve(u32 level_idx) {
+  static const s8 keys[4] = { 'W', 'A', 'D', 'S' };
+  const level_entity *entities = level_entities(lvl);
+  u32 i, arrows = 0, depth = 0, widest = 0, expanded = 0, legal = 0, added = 0;
+  u8 buf[sizeof (state) + LEVEL_ENTITIES_CAP / 8 + 1];
+  state *start = (state *)buf;
+  f64 time = now();
+  memset(arrow_at, 0xff, sizeof (arrow_at));
+  for (i = 0; i < lvl->entities_amount; i++) {
+    if (entities[i].type != LEVEL_ENTITY_ARROW) continue;
+    arrow_at[entities[i].y][entities[i].x] = arrows;
+    arrow_dir[arrows++] = entities[i].arg;
+  }
+  state_size  = sizeof (state) + (arrows + 7) / 8;
+  record_size = (RECORD_HEADER + state_size + 3) & ~3u;
+  memset((void *)table, 0, (table_mask + 1) * sizeof (u32));
+  states_amount = 0;
+  solution_found = 0;
+  out_of_states = 0;
+  memset(buf, 0, sizeof (buf));
+  start->player_x = lvl->player_x;
+  start->player_y = lvl->player_y;
+  start->x_min = lvl->x;
+  start->y_min = lvl->y;
+  start->x_max = lvl->x + lvl->w;
+  start->y_max = lvl->y + lvl->h;
+  visit(buf, NO_PARENT, 0);
+  for (layer_end = 0; !solution_found && !out_of_states && layer_end < states_amount; depth++) {
+    cursor = layer_end;
+    layer_end = states_amount;
+    if (layer_end - cursor > widest) widest = layer_end - cursor;
+    for (i = 0; i < threads_amount; i++) pthread_create(&workers[i].thread, 0, work, &workers[i]);
+    for (i = 0; i < threads_amount; i++) pthread_join(workers[i].thread, 0);
+  }
+  for (i = 0; i < threads_amount; i++) {
+    expanded += workers[i].expanded;
+    legal    += workers[i].legal;
+    added    += workers[i].added;
+    workers[i].expanded = workers[i].legal = workers[i].added = 0;
+  }
+  printf("level %u: ", level_idx);
+  if (solution_found) {
+    s8 *moves = malloc(depth);
+    u32 n = 0, idx = solution_parent;
+    moves[n++] = keys[solution_move];
+    for (; record_parent(idx) != NO_PARENT; idx = record_parent(idx)) moves[n++] = keys[record_move(idx)];
+    printf("solvable in %u moves, ", depth);
+    while (n) putchar(moves[--n]);
+    free(moves);
+  } else if (out_of_states) {
+    printf("gave up after %u states", states_cap);
+  } else {
+    printf("unsolvable");
+  }
+  printf("\n  %u states, widest layer %u, branching %.2f legal %.2f new, %u arrows, %.1f ms\n",
+      states_amount < states_cap ? states_amount : states_cap, widest,
+      expanded ? (f64)legal / expanded : 0, expanded ? (f64)added / expanded : 0,
+      arrows, (now() - time) * 1000);
+  return solution_found;
+}
+
+/* usage: solve_levels [-j threads] [-s max_states] [-x level]... <pack>
+ * exits with 2 when a level can't be solved, -x marks a level that isn't meant to be and it
+ * is an error for it to be solvable instead */
+s32
+main(s32 argc, s8 **argv) {
+  u8 *pack;
+  static b8 unsolvable[LEVELS_CAP];
+  u32 size, i, table_size, levels_seen = 0, unexpected = 0, entities_max = 0;
+  const pack_header *header;
+  const pack_entry *entries;
+  FILE *in;
+  s32 arg = 1;
+  threads_amount = sysconf(_SC_NPROCESSORS_ONLN);
+  states_cap = STATES_CAP;
+  for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    if (!strcmp(argv[arg], "-j"))      threads_amount = strtoul(argv[arg + 1], 0, 10);
+    else if (!strcmp(argv[arg], "-s")) states_cap = strtoul(argv[arg + 1], 0, 10);
+    else if (!strcmp(argv[arg], "-x") && strtoul(argv[arg + 1], 0, 10) < LEVELS_CAP) unsolvable[strtoul(argv[arg + 1], 0, 10)] = 1;
+    else break;
+  }
+  if (arg + 1 != argc || !states_cap) {
+    fprintf(stderr, "usage: %s [-j threads] [-s max_states] [-x level]... <pack>\n", argv[0]);
+    return 1;
+  }
+  if (threads_amount < 1) threads_amount = 1;
+  if (threads_amount > THREADS_CAP) threads_amount = THREADS_CAP;
+  if (!(in = fopen(argv[arg], "rb"))) {
+    fprintf(stderr, "error: couldn't open '%s'\n", argv[arg]);
+    return 1;
+  }
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  pack = malloc(size);
+  if (!pack || fread(pack, 1, size, in) != size) {
+    fprintf(stderr, "error: couldn't read '%s'\n", argv[arg]);
+    return 1;
+  }
+  fclose(in);
+  header  = (const pack_header *)pack;
+  entries = (const pack_entry *)(header + 1);
+  if (size < sizeof (pack_header) || memcmp(header->magic, PACK_MAGIC, sizeof (header->magic)) ||
+      header->version != PACK_VERSION ||
+      header->entries_amount > (size - sizeof (pack_header)) / sizeof (pack_entry)) {
+    fprintf(stderr, "error: '%s' isn't a pack of this version\n", argv[arg]);
+    return 1;
+  }
+  /* the levels are checked first, the records are sized by the level with the most entities */
+  for (i = 0; i < header->entries_amount; i++) {
+    u32 table_end;
+    if (strncmp(entries[i].name, "level", PACK_NAME_SIZE)) continue;
+    lvl = (const pack_level *)(pack + entries[i].offset);
+    if (entries[i].offset > size || entries[i].size > size - entries[i].offset ||
+        entries[i].size < sizeof (pack_level) || lvl->x + lvl->w > LVL_MAX_W || lvl->y + lvl->h > LVL_MAX_H ||
+        entries[i].size < (table_end = sizeof (pack_level) + (level_chunks(lvl) + 1) * sizeof (u16)) ||
+        lvl->entities_amount > LEVEL_ENTITIES_CAP ||
+        lvl->entities_amount > (entries[i].size - table_end) / sizeof (level_entity)) {
+      fprintf(stderr, "error: bad level %u in pack\n", levels_seen);
+      return 1;
+    }
+    if (lvl->entities_amount > entities_max) entities_max = lvl->entities_amount;
+    levels_seen++;
+  }
+  /* the visited set is kept at most half full */
+  for (table_size = 1; table_size < states_cap * 2; table_size <<= 1);
+  table_mask = table_size - 1;
+  table = malloc(table_size * sizeof (u32));
+  arena = malloc((size_t)states_cap * ((RECORD_HEADER + sizeof (state) + (entities_max + 7) / 8 + 3) & ~3u));
+  if (!table || !arena) {
+    fprintf(stderr, "error: couldn't allocate %u states\n", states_cap);
+    return 1;
+  }
+  levels_seen = 0;
+  for (i = 0; i < header->entries_amount; i++) {
+    b8 solved;
+    if (strncmp(entries[i].name, "level", PACK_NAME_SIZE)) continue;
+    lvl = (const pack_level *)(pack + entries[i].offset);
+    solved = solve(levels_seen);
+    if (levels_seen < LEVELS_CAP && unsolvable[levels_seen]) {
+      printf(solved ? "  but it was expected to be unsolvable\n" : "  as expected\n");
+      unexpected += solved;
+    } else {
+      unexpected += !solved;
+    }
+    levels_seen++;
+  }
+  return unexpected ? 2 : 0;
+}